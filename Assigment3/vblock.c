@@ -7,31 +7,268 @@
 #include <linux/device.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
-#include <linux/semaphore.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/file.h>
 #include <linux/fcntl.h>
 #include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/sched/mm.h>
+#include <linux/seqlock.h>
+#include <linux/uio.h>
+#include <linux/bitmap.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/ktime.h>
+#include <linux/rwsem.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/rhashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/capability.h>
+#include <linux/lz4.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <linux/fadvise.h>
+#include <linux/crc32c.h>
+#include <linux/pfn_t.h>
 
 #include "vblock_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "vblock_trace.h"
+
 #define DEVICE_NAME     "vblock"
 #define CLASS_NAME      "vblock"
+#define BLK_NAME        "vblk"
+
+/* Bounce buffer size used when streaming a backup to a file */
+#define VBLOCK_BACKUP_CHUNK  (1UL << 20)
+
+/* Longest write applied atomically across regions. Spanning writes
+ * are bounced through a buffer this big at most, taken before the
+ * region locks; a longer binary write is cut here (a short count).
+ */
+#define VBLOCK_SPAN_MAX      (1UL << 20)
+
+/* --- Storage -------------------------------------------------------
+ *
+ * The device is backed by an xarray of pages indexed by page number.
+ * A page is allocated the first time any byte in it is written; holes
+ * read back as zeros, so an untouched multi-GB device costs almost no
+ * memory.
+ */
+
+struct vblock_store {
+    struct xarray pages;        /* page index -> struct page * */
+    atomic_long_t nr_pages;     /* resident pages */
+    /* Data store only, once mapped: where holes may be mapped as the
+     * zero page (see vblock_vm_fault())
+     */
+    struct address_space *mapping;
+};
+
+/* Who locked a region and when, under its region_mutex */
+struct vblock_region_meta {
+    pid_t owner_pid;            /* tgid of the locker */
+    uid_t owner_uid;
+    u64 lock_time;              /* CLOCK_REALTIME ns at lock */
+    u64 lock_gen;               /* lock and unlock transitions */
+};
+
+/* Compressed storage (compress=1). A cold region has no data pages,
+ * only an LZ4 copy, and its region_cold bit set; it is thawed back
+ * into pages on first access. Resident regions sit on hot_lru, and
+ * region_ref marks them used since the evictor last looked (a CLOCK
+ * approximation of LRU, so readers never take lru_lock).
+ */
+struct vblock_zregion {
+    struct list_head lru;       /* on hot_lru while resident */
+    void *zbuf;                 /* compressed contents while cold */
+    unsigned int zlen;
+};
+
+/* Lockless attempts before a reader falls back to region_mutex */
+#define VBLOCK_SEQ_RETRIES  2
+
+/* Wait queues per device for change watchers, each for a run of regions */
+#define VBLOCK_WATCH_SHARDS 64
+
+/* --- Devices --------------------------------------------------------
+ *
+ * Each /dev/vblockN (and /dev/vblkN) is one struct vblock_dev with its
+ * own geometry, stores, per-region state, keys and workers. Nothing in
+ * it is shared with another device, so tenants on different devices
+ * never contend on a lock or a cacheline. Per-region state is
+ * allocated when the device is created, one entry (or bit) per region;
+ * see vblock_regions_alloc(). Devices live until the module unloads.
+ */
+
+struct vblock_dev {
+    int id;                     /* N in /dev/vblockN and /dev/vblkN */
+    unsigned long size;
+    unsigned int region_size;
+    unsigned int num_regions;   /* size / region_size */
+
+    struct vblock_store data;
+    struct vblock_store mirror; /* used only if mirror_enable != 0 */
+
+    /* Region lock state: bit i set => region i locked. Changed with
+     * atomic bitops under the region mutex, tested without it.
+     */
+    unsigned long *region_lock_bitmap;
+    struct vblock_region_meta *region_meta;
+
+    /* Per-region mutex: protects writes/lock/unlock/erase/mirror for
+     * that region
+     */
+    struct mutex *region_mutex;
+
+    /* Per-region sequence count bumped around every data or mirror
+     * change, so readers can copy without the mutex and retry on
+     * overlap. Writers may sleep inside their section (page allocation,
+     * user copies), so readers never spin on it; see region_read_iter().
+     */
+    seqcount_t *region_seq;
+
+    /* Per-region generation, bumped by region_changed() inside a writer
+     * section (under the mutex and the seqcount). It may count a write
+     * that changed nothing, but never misses one; callers use it to
+     * skip regions they have already seen.
+     */
+    u64 *region_gen;
+
+    /* Regions changed since the last successful backup (full or delta) */
+    unsigned long *backup_dirty;
+
+    /* Orders backups so every delta is relative to the one before it */
+    struct mutex backup_mutex;
+    u64 backup_seq;
 
-/* --- Storage ------------------------------------------------------- */
+    /* Asynchronous backups, by id; see Asynchronous backup jobs.
+     * job_mutex protects job state/owner and vblock_file.jobs_done,
+     * and job_wq wakes pollers of the owning descriptors.
+     */
+    struct xarray jobs;
+    u32 next_job;
+    struct mutex job_mutex;
+    wait_queue_head_t job_wq;
+
+    /* Point-in-time snapshot. While snap_active, the first change to a
+     * region copies it into snap and sets its snap_preserved bit, so
+     * the snapshot view of a region is snap once preserved and the live
+     * data until then. snap_rwsem is held shared by snapshot readers
+     * and exclusive by create/drop; snap_mutex serializes the copies
+     * and nests inside region_mutex and mmap_lock. Writer sections hold
+     * snap_freeze shared, outside region_mutex, so create can wait out
+     * those in flight without taking every region lock.
+     */
+    struct vblock_store snap;
+    unsigned long *snap_preserved;
+    bool snap_active;
+    u64 snap_id;
+    struct rw_semaphore snap_rwsem;
+    struct mutex snap_mutex;
+    struct percpu_rw_semaphore snap_freeze;
+
+    /* Writes covering several regions hold all of their mutexes at
+     * once, taken in ascending order. span_mutex serializes such
+     * writers (and is the lockdep nest lock for the region mutexes);
+     * they also bump span_seq so a reader crossing regions sees the
+     * write whole or not at all.
+     */
+    struct mutex span_mutex;
+    seqcount_t span_seq;
+
+    /* Shared writable mmaps covering each region, under map_lock.
+     * A locked region cannot gain one, and cannot be locked while one
+     * exists. mmap hooks run under mmap_lock while readers fault with a
+     * region mutex held, so this is a spinlock nested inside
+     * region_mutex, never outside.
+     */
+    int *region_wmaps;
+    spinlock_t map_lock;
+
+    /* Per-region CRC32C of the data, recorded lazily (see Checksums)
+     * and valid while the region_csum_valid bit is set, under
+     * region_mutex. Writers clear the bit; so does the end of a
+     * writable mapping, which also bumps wmap_epoch under map_lock.
+     */
+    u32 *region_csum;
+    unsigned long *region_csum_valid;
+    unsigned long wmap_epoch;
+
+    /* Regions whose mirror is behind the data: written in mirror_async
+     * mode, or unmapped since their last sync. mirror_pending (bytes,
+     * under region_mutex) and mirror_since (ns, when the bit was set)
+     * feed the lag figures in VBLOCK_MIRROR_STAT.
+     */
+    unsigned long *mirror_dirty;
+    u64 *mirror_pending;
+    u64 *mirror_since;
+    atomic64_t mirror_batches;
+    atomic64_t mirror_synced;
+    struct delayed_work mirror_work;
+
+    /* Compressed storage; see vblock_zregion */
+    struct vblock_zregion *region_z;
+    unsigned long *region_cold;
+    unsigned long *region_ref;
+    struct list_head hot_lru;
+    spinlock_t lru_lock;
+    unsigned int nr_hot;
+    atomic64_t z_bytes;         /* total size of compressed copies */
+    atomic64_t z_thaws;
+    atomic64_t z_freezes;
+    atomic64_t z_rejects;       /* regions that didn't compress */
+    u64 __percpu *z_accesses;
+    struct work_struct compress_work;
+    /* The freezer runs from one work item, so its buffers are shared */
+    void *z_src, *z_dst, *z_wrkmem;
 
-static u8 vblock_data[VBLOCK_SIZE];
-static u8 vblock_mirror[VBLOCK_SIZE];   /* used only if mirror_enable != 0 */
+    /* Lazily erased regions: they read as zeros, and their pages are
+     * freed by the next user of the region or by reap_work. See
+     * region_erase(). nr_maps counts live mappings of the device, whose
+     * pages must not be freed under them.
+     */
+    unsigned long *region_erased;
+    atomic_t nr_maps;
+    struct work_struct reap_work;
+
+    /* Keys that open locked regions; see Key store */
+    struct rhashtable keys;
+    struct mutex key_mutex;
+    /* Bumped on every key or lock change; revokes sessions (see Sessions) */
+    atomic_long_t auth_gen;
 
-/* Region lock state: bit i set => region i locked */
-static u8 region_lock_bitmap;           /* 8 bits for 8 regions */
+    /* Change notification; see Watches. region_event holds the
+     * watch_seq of each region's last change, kept up only while
+     * region_watchers says some file watches the region.
+     */
+    u64 *region_event;
+    atomic_t *region_watchers;
+    atomic64_t watch_seq;
+    unsigned int watch_span;    /* regions per watch_wq entry */
+    wait_queue_head_t watch_wq[VBLOCK_WATCH_SHARDS];
 
-/* Per-region mutex: protects writes/lock/unlock/erase/mirror for that region */
-static struct mutex region_mutex[VBLOCK_NUM_REGIONS];
+    /* See Statistics */
+    u64 * __percpu *rstats;     /* [region][RSTAT_NR] */
+    struct vblock_latency __percpu *lat;
+    struct dentry *debugfs;
 
-/* Semaphore for region read operations + backup coordination */
-static struct semaphore vblock_read_sem;
+    struct cdev cdev;
+    struct blk_mq_tag_set tag_set;
+    struct gendisk *disk;
+};
 
 /* --- Module parameters --------------------------------------------- */
 
@@ -39,537 +276,5094 @@ static struct semaphore vblock_read_sem;
 
 static int user_keys[MAX_KEYS];
 static int key_count;
-module_param_array(user_keys, int, &key_count, 0644);
-MODULE_PARM_DESC(user_keys, "Authorized integer keys for write access to locked regions");
+module_param_array(user_keys, int, &key_count, 0444);
+MODULE_PARM_DESC(user_keys, "Keys loaded into the key store of every device at init (more via VBLOCK_KEY_ADD)");
 
 static int mirror_enable;
 module_param(mirror_enable, int, 0644);
-MODULE_PARM_DESC(mirror_enable, "Enable mirroring to secondary 4KB buffer (0=off,1=on)");
-int vblock_backup_to_file(const char *path); 
+MODULE_PARM_DESC(mirror_enable, "Enable mirroring to a secondary sparse store (0=off,1=on)");
+
+static int mirror_async;
+module_param(mirror_async, int, 0644);
+MODULE_PARM_DESC(mirror_async, "Copy writes to the mirror from a worker instead of inline (0=off,1=on)");
+
+static unsigned int mirror_batch_ms = 10;
+module_param(mirror_batch_ms, uint, 0644);
+MODULE_PARM_DESC(mirror_batch_ms, "Delay before the mirror worker runs, batching writes (ms, default 10)");
+
+static unsigned int nr_devices = 1;
+module_param_named(devices, nr_devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Devices created at load, /dev/vblock0..N-1 (default 1; more via VBLOCK_DEV_ADD)");
+
+/* Geometry per device: entry i is for device i, and devices past the
+ * last entry given take the last one.
+ */
+static unsigned long dev_size[VBLOCK_MAX_DEVICES] = { VBLOCK_SIZE };
+static int nr_dev_size;
+module_param_array_named(size, dev_size, ulong, &nr_dev_size, 0444);
+MODULE_PARM_DESC(size, "Total device size in bytes, per device; a multiple of 512 (default 4096)");
+
+static unsigned int dev_region_size[VBLOCK_MAX_DEVICES] = {
+    VBLOCK_REGION_SIZE
+};
+static int nr_dev_region_size;
+module_param_array_named(region_size, dev_region_size, uint,
+                         &nr_dev_region_size, 0444);
+MODULE_PARM_DESC(region_size, "Region size in bytes, per device; size must be a multiple (default 512)");
+
+static bool vblock_compress;
+module_param_named(compress, vblock_compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Keep cold regions LZ4-compressed (region_size must be a multiple of PAGE_SIZE; disables mmap)");
+
+static unsigned int hot_regions = 64;
+module_param(hot_regions, uint, 0644);
+MODULE_PARM_DESC(hot_regions, "Regions kept decompressed per device when compress=1 (default 64)");
+
+static unsigned int nr_queues;
+module_param(nr_queues, uint, 0444);
+MODULE_PARM_DESC(nr_queues, "blk-mq hardware queues for each /dev/vblkN (0 = one per CPU)");
+
+static unsigned int queue_depth = 128;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "blk-mq queue depth per hardware queue (default 128)");
+
+static unsigned int vblock_csum = 1;
+module_param_named(csum, vblock_csum, uint, 0644);
+MODULE_PARM_DESC(csum, "Region CRC32C checks: 0=off, 1=in backups (default), 2=also on VBLOCK_READ_REGION(_BUF)");
+
+static char *restore_image[VBLOCK_MAX_DEVICES];
+static int nr_restore_image;
+module_param_array_named(restore, restore_image, charp, &nr_restore_image,
+                         0444);
+MODULE_PARM_DESC(restore, "Image or delta loaded into each device, with its locks, before it appears (see VBLOCK_RESTORE); raw:<path> loads a raw image, empty entries skip a device");
+
+int vblock_backup_to_file(const char *path);
+struct vblock_file;
+static int vblock_backup_path(struct vblock_dev *vd, const char *path,
+                              u32 flags);
+static int vblock_restore_path(struct vblock_dev *vd, const char *path,
+                               u32 flags, unsigned int *restored);
+static int region_thaw(struct vblock_dev *vd, int region, bool nowait);
+static int __region_thaw(struct vblock_dev *vd, int region, gfp_t gfp);
+static void region_reap(struct vblock_dev *vd, int region);
+static bool region_may_write(struct vblock_dev *vd, int region,
+                             struct vblock_file *vf, bool has_key, int key);
+static bool backup_flags_valid(u32 flags);
+static long vblock_backup_async(struct vblock_file *vf, void __user *argp);
+static long vblock_backup_status(struct vblock_file *vf, void __user *argp);
+static void vblock_jobs_release(struct vblock_file *vf);
+static long vblock_dev_add(void __user *argp);
 /* --- Char dev bookkeeping ----------------------------------------- */
 
-static dev_t vblock_dev;
-static struct cdev vblock_cdev;
+static dev_t vblock_devt;       /* minor N is /dev/vblockN */
 static struct class *vblock_class;
 
+/* Created devices, by id. Entries are only added (under
+ * vblock_devs_mutex) and stay until unload.
+ */
+static struct vblock_dev *vblock_devs[VBLOCK_MAX_DEVICES];
+static unsigned int vblock_nr_devs;
+static DEFINE_MUTEX(vblock_devs_mutex);
+
+/* --- Block dev bookkeeping ---------------------------------------- */
+
+static int vblk_major;
+
+/* --- Per-open state ----------------------------------------------- */
+
+struct vblock_file {
+    struct vblock_dev *vd;
+    bool binary;        /* write() stores raw bytes at the file position */
+    unsigned int jobs_done;   /* finished, unreaped backup jobs */
+
+    /* Session (VBLOCK_AUTH): while auth, caps holds the regions this
+     * file may write with key, valid while auth_gen equals the device's.
+     * Under auth_lock; see session_may_write().
+     */
+    bool auth;
+    int key;
+    unsigned long auth_gen;
+    unsigned long *caps;
+    spinlock_t auth_lock;
+
+    /* Watched regions (VBLOCK_WATCH), and how far VBLOCK_WATCH_CHANGES
+     * has reported: changes after watch_since, with a pass over the
+     * regions resumed at watch_next up to watch_seq watch_upto. Under
+     * watch_mutex; poll reads them without it.
+     */
+    unsigned long *watch;
+    u64 watch_shards;           /* watch_wq entries the mask touches */
+    u64 watch_since;
+    u64 watch_upto;
+    unsigned int watch_next;
+    struct mutex watch_mutex;
+};
+
 /* --- Helpers ------------------------------------------------------- */
 
-static inline bool region_is_locked(int region)
+static inline struct vblock_dev *file_vd(struct file *filp)
 {
-    return region_lock_bitmap & (1U << region);
+    return ((struct vblock_file *)filp->private_data)->vd;
 }
 
-static inline void lock_region_bit(int region)
+static inline bool region_is_locked(struct vblock_dev *vd, int region)
 {
-    region_lock_bitmap |= (1U << region);
+    return test_bit(region, vd->region_lock_bitmap);
 }
 
-static inline void unlock_region_bit(int region)
+/* Marks a region whose change is being recorded; see watch_notify() */
+#define VBLOCK_EVENT_PENDING    U64_MAX
+
+/*
+ * Record a change to @region for its watchers and wake them. Caller
+ * holds the region mutex. The region is marked pending before its
+ * sequence number is taken, so a VBLOCK_WATCH_CHANGES pass that reads
+ * watch_seq first either sees the mark or gets a watch_seq below the
+ * change, and reports it on its next pass; see watch_changes().
+ */
+static inline void watch_notify(struct vblock_dev *vd, int region)
 {
-    region_lock_bitmap &= ~(1U << region);
+    wait_queue_head_t *wq = &vd->watch_wq[region / vd->watch_span];
+
+    if (!atomic_read(&vd->region_watchers[region]))
+        return;
+
+    /* Whoever sees the mark sees the new generation too */
+    smp_wmb();
+    WRITE_ONCE(vd->region_event[region], VBLOCK_EVENT_PENDING);
+    /* Fully ordered, so the mark is visible before the new watch_seq */
+    WRITE_ONCE(vd->region_event[region],
+               atomic64_inc_return(&vd->watch_seq));
+
+    if (wq_has_sleeper(wq))
+        wake_up_interruptible_poll(wq, EPOLLIN | EPOLLRDNORM);
 }
 
-static bool key_is_authorized(int key)
+/* Caller holds region_mutex; records the caller as owner */
+static inline void lock_region_bit(struct vblock_dev *vd, int region)
 {
-    int i;
-    for (i = 0; i < key_count; ++i) {
-        if (user_keys[i] == key)
-            return true;
+    struct vblock_region_meta *m = &vd->region_meta[region];
+
+    if (test_and_set_bit(region, vd->region_lock_bitmap))
+        return;
+
+    atomic_long_inc(&vd->auth_gen);
+    m->owner_pid = task_tgid_vnr(current);
+    m->owner_uid = from_kuid_munged(current_user_ns(), current_uid());
+    m->lock_time = ktime_get_real_ns();
+    m->lock_gen++;
+    watch_notify(vd, region);
+}
+
+/* Caller holds region_mutex */
+static inline void unlock_region_bit(struct vblock_dev *vd, int region)
+{
+    if (test_and_clear_bit(region, vd->region_lock_bitmap)) {
+        atomic_long_inc(&vd->auth_gen);
+        vd->region_meta[region].lock_gen++;
+        watch_notify(vd, region);
     }
-    return false;
 }
 
-/* --- File operations ----------------------------------------------- */
+static inline loff_t region_start(struct vblock_dev *vd, unsigned int region)
+{
+    return (loff_t)region * vd->region_size;
+}
 
-static int vblock_open(struct inode *inode, struct file *filp)
+/* Compressed away by region_freeze(); see vblock_zregion */
+static inline bool region_is_cold(struct vblock_dev *vd, int region)
 {
-    /* nothing special; could track opens here if you want */
-    return 0;
+    return vblock_compress && test_bit_acquire(region, vd->region_cold);
 }
 
-static int vblock_release(struct inode *inode, struct file *filp)
+/* The stores don't hold the region's contents: it is cold or lazily
+ * erased, and __region_thaw() must run before they are used.
+ */
+static inline bool region_needs_thaw(struct vblock_dev *vd, int region)
 {
-    return 0;
+    return test_bit_acquire(region, vd->region_erased) ||
+           region_is_cold(vd, region);
 }
 
-/* llseek to support arbitrary offsets */
-static loff_t vblock_llseek(struct file *file, loff_t off, int whence)
+/* Data written through a shared mapping bypasses vblock_write(), so
+ * regions with a live writable mapping are treated as always dirty.
+ */
+static inline bool region_mmap_dirty(struct vblock_dev *vd, int region)
 {
-    loff_t newpos = 0;
+    return READ_ONCE(vd->region_wmaps[region]) != 0;
+}
 
-    switch (whence) {
-    case SEEK_SET:
-        newpos = off;
-        break;
-    case SEEK_CUR:
-        newpos = file->f_pos + off;
-        break;
-    case SEEK_END:
-        newpos = VBLOCK_SIZE + off;
-        break;
-    default:
-        return -EINVAL;
+/* --- Statistics -----------------------------------------------------
+ *
+ * Per-region counters and latency histograms, all per CPU: a CPU only
+ * writes its own copy, with preemption off, so the I/O paths never
+ * dirty a shared cacheline. Readers (debugfs, VBLOCK_GET_STATS) sum
+ * over the CPUs without stopping writers, so a snapshot is not atomic.
+ * The region counters can exceed the per-CPU allocator's unit size, so
+ * rstats on each CPU points at an array from that CPU's node.
+ */
+
+enum vblock_rstat {
+    RSTAT_READS,
+    RSTAT_READ_BYTES,
+    RSTAT_WRITES,
+    RSTAT_WRITE_BYTES,
+    RSTAT_ERASES,
+    RSTAT_LOCK_FAILS,
+    RSTAT_KEY_FAILS,
+    RSTAT_CSUM_ERRORS,
+    RSTAT_REPAIRS,
+    RSTAT_NR,
+};
+
+static struct dentry *vblock_debugfs;   /* one directory per device below */
+
+static inline void region_stat_add(struct vblock_dev *vd, int region,
+                                   enum vblock_rstat stat, u64 n)
+{
+    u64 *c = *get_cpu_ptr(vd->rstats);
+
+    c[region * RSTAT_NR + stat] += n;
+    put_cpu_ptr(vd->rstats);
+}
+
+/* One read or write of @bytes */
+static inline void region_stat_io(struct vblock_dev *vd, int region, bool write,
+                                  u64 bytes)
+{
+    u64 *c = *get_cpu_ptr(vd->rstats) + region * RSTAT_NR;
+
+    c[write ? RSTAT_WRITES : RSTAT_READS]++;
+    c[write ? RSTAT_WRITE_BYTES : RSTAT_READ_BYTES] += bytes;
+    put_cpu_ptr(vd->rstats);
+}
+
+/* Bucket b >= 1 counts [2^(b-1), 2^b) ns; the last one is open-ended */
+static inline void lat_record(struct vblock_dev *vd, int which, u64 start)
+{
+    unsigned int b = min_t(unsigned int, fls64(local_clock() - start),
+                           VBLOCK_HIST_BUCKETS - 1);
+
+    this_cpu_inc(vd->lat->hist[which][b]);
+}
+
+/* Take a region mutex, timing the wait if it is contended */
+static inline void region_lock(struct vblock_dev *vd, int region)
+{
+    u64 t0;
+
+    if (mutex_trylock(&vd->region_mutex[region]))
+        return;
+
+    t0 = local_clock();
+    mutex_lock(&vd->region_mutex[region]);
+    lat_record(vd, VBLOCK_LAT_LOCK_WAIT, t0);
+    trace_vblock_lock_wait(vd->id, region, t0);
+}
+
+static void region_stats_sum(struct vblock_dev *vd, int region,
+                             struct vblock_region_stats *st)
+{
+    int cpu;
+
+    memset(st, 0, sizeof(*st));
+    for_each_possible_cpu(cpu) {
+        const u64 *c = *per_cpu_ptr(vd->rstats, cpu) + region * RSTAT_NR;
+
+        st->reads       += READ_ONCE(c[RSTAT_READS]);
+        st->read_bytes  += READ_ONCE(c[RSTAT_READ_BYTES]);
+        st->writes      += READ_ONCE(c[RSTAT_WRITES]);
+        st->write_bytes += READ_ONCE(c[RSTAT_WRITE_BYTES]);
+        st->erases      += READ_ONCE(c[RSTAT_ERASES]);
+        st->lock_fails  += READ_ONCE(c[RSTAT_LOCK_FAILS]);
+        st->key_fails   += READ_ONCE(c[RSTAT_KEY_FAILS]);
+        st->csum_errors += READ_ONCE(c[RSTAT_CSUM_ERRORS]);
+        st->repairs     += READ_ONCE(c[RSTAT_REPAIRS]);
     }
+}
+
+static void latency_sum(struct vblock_dev *vd, struct vblock_latency *lat)
+{
+    int cpu, i, b;
+
+    memset(lat, 0, sizeof(*lat));
+    for_each_possible_cpu(cpu) {
+        const struct vblock_latency *l = per_cpu_ptr(vd->lat, cpu);
+
+        for (i = 0; i < VBLOCK_LAT_NR; ++i)
+            for (b = 0; b < VBLOCK_HIST_BUCKETS; ++b)
+                lat->hist[i][b] += READ_ONCE(l->hist[i][b]);
+    }
+}
+
+/* Copies counters for regions [first, first + nr) and the histograms */
+static long vblock_ioctl_get_stats(struct vblock_dev *vd, void __user *argp)
+{
+    struct vblock_stats req;
+    struct vblock_region_stats __user *out;
+    struct vblock_region_stats st;
+    struct vblock_latency *lat;
+    u32 i;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
 
-    if (newpos < 0 || newpos > VBLOCK_SIZE)
+    if (req.first > vd->num_regions)
         return -EINVAL;
 
-    file->f_pos = newpos;
-    return newpos;
+    req.nr = min(req.nr, vd->num_regions - req.first);
+    out = u64_to_user_ptr(req.regions);
+    if (!out)
+        req.nr = 0;
+
+    for (i = 0; i < req.nr; ++i) {
+        region_stats_sum(vd, req.first + i, &st);
+        if (copy_to_user(&out[i], &st, sizeof(st)))
+            return -EFAULT;
+        cond_resched();
+    }
+
+    if (req.latency) {
+        lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+        if (!lat)
+            return -ENOMEM;
+
+        latency_sum(vd, lat);
+        if (copy_to_user(u64_to_user_ptr(req.latency), lat, sizeof(*lat))) {
+            kfree(lat);
+            return -EFAULT;
+        }
+        kfree(lat);
+    }
+
+    return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
 }
 
-/* Arbitrary read: always allowed, ignores lock state */
-static ssize_t vblock_read(struct file *filp, char __user *buf,
-                           size_t count, loff_t *ppos)
+/* /sys/kernel/debug/vblock/vblockN/regions: regions with any activity */
+static int vblock_regions_show(struct seq_file *m, void *v)
 {
-    loff_t pos = *ppos;
-    size_t to_copy;
-    size_t remaining = count;
+    struct vblock_dev *vd = m->private;
+    struct vblock_region_stats st;
     int region;
 
-    if (pos >= VBLOCK_SIZE)
-        return 0;
+    seq_puts(m, "region reads read_bytes writes write_bytes erases lock_fails key_fails csum_errors repairs\n");
+    for (region = 0; region < vd->num_regions; ++region) {
+        region_stats_sum(vd, region, &st);
+        if (!st.reads && !st.writes && !st.erases &&
+            !st.lock_fails && !st.key_fails && !st.csum_errors)
+            continue;
 
-    if (pos + count > VBLOCK_SIZE)
-        to_copy = VBLOCK_SIZE - pos;
-    else
-        to_copy = count;
+        seq_printf(m, "%d %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+                   region, st.reads, st.read_bytes, st.writes,
+                   st.write_bytes, st.erases, st.lock_fails, st.key_fails,
+                   st.csum_errors, st.repairs);
+        cond_resched();
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vblock_regions);
 
-    if (to_copy == 0)
-        return 0;
+/* /sys/kernel/debug/vblock/vblockN/latency: non-empty buckets, in ns */
+static int vblock_latency_show(struct seq_file *m, void *v)
+{
+    static const char * const names[VBLOCK_LAT_NR] = {
+        [VBLOCK_LAT_READ]      = "read",
+        [VBLOCK_LAT_WRITE]     = "write",
+        [VBLOCK_LAT_BACKUP]    = "backup",
+        [VBLOCK_LAT_LOCK_WAIT] = "lock_wait",
+    };
+    struct vblock_dev *vd = m->private;
+    struct vblock_latency *lat;
+    int i, b;
 
-    /* We want some region-level synchronization.
-     * For each region touched, take that region's mutex while copying.
-     * Reads are protected against concurrent writers at region granularity.
-     */
+    lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+    if (!lat)
+        return -ENOMEM;
 
-    size_t done = 0;
+    latency_sum(vd, lat);
+    for (i = 0; i < VBLOCK_LAT_NR; ++i) {
+        seq_printf(m, "%s:\n", names[i]);
+        for (b = 0; b < VBLOCK_HIST_BUCKETS; ++b) {
+            if (!lat->hist[i][b])
+                continue;
+            if (b == VBLOCK_HIST_BUCKETS - 1)
+                seq_printf(m, "  >= %llu: %llu\n", 1ULL << (b - 1),
+                           lat->hist[i][b]);
+            else
+                seq_printf(m, "  < %llu: %llu\n", 1ULL << b,
+                           lat->hist[i][b]);
+        }
+    }
 
-    while (remaining && pos < VBLOCK_SIZE) {
-        region = pos / VBLOCK_REGION_SIZE;
-        size_t region_offset = pos % VBLOCK_REGION_SIZE;
-        size_t region_left = VBLOCK_REGION_SIZE - region_offset;
-        size_t chunk = min(remaining, region_left);
+    kfree(lat);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vblock_latency);
 
-        if (pos + chunk > VBLOCK_SIZE)
-            chunk = VBLOCK_SIZE - pos;
+/* debugfs is best effort; its errors are not the module's */
+static void vblock_debugfs_init(struct vblock_dev *vd)
+{
+    char name[16];
 
-        mutex_lock(&region_mutex[region]);
+    snprintf(name, sizeof(name), DEVICE_NAME "%d", vd->id);
+    vd->debugfs = debugfs_create_dir(name, vblock_debugfs);
+    debugfs_create_file("regions", 0444, vd->debugfs, vd,
+                        &vblock_regions_fops);
+    debugfs_create_file("latency", 0444, vd->debugfs, vd,
+                        &vblock_latency_fops);
+}
 
-        if (copy_to_user(buf + done, &vblock_data[pos], chunk)) {
-            mutex_unlock(&region_mutex[region]);
-            return -EFAULT;
+/* --- Key store ------------------------------------------------------
+ *
+ * Keys that open locked regions live in an rhashtable. Lookups run
+ * under rcu_read_lock() only; add and revoke (CAP_SYS_ADMIN) are
+ * serialized by key_mutex and free replaced entries after a
+ * grace period. A key may be bound to a set of regions.
+ */
+
+struct vblock_key {
+    struct rhash_head node;
+    int key;
+    unsigned long *regions;     /* NULL: valid for every region */
+    struct rcu_head rcu;
+};
+
+static const struct rhashtable_params vblock_key_params = {
+    .key_len             = sizeof(int),
+    .key_offset          = offsetof(struct vblock_key, key),
+    .head_offset         = offsetof(struct vblock_key, node),
+    .automatic_shrinking = true,
+};
+
+/* True if @key opens @region */
+static bool key_is_authorized(struct vblock_dev *vd, int key, int region)
+{
+    struct vblock_key *k;
+    bool ok;
+
+    rcu_read_lock();
+    k = rhashtable_lookup(&vd->keys, &key, vblock_key_params);
+    ok = k && (!k->regions || test_bit(region, k->regions));
+    rcu_read_unlock();
+    return ok;
+}
+
+static void vblock_key_free(void *ptr, void *arg)
+{
+    struct vblock_key *k = ptr;
+
+    bitmap_free(k->regions);
+    kfree(k);
+}
+
+static void vblock_key_free_rcu(struct rcu_head *head)
+{
+    vblock_key_free(container_of(head, struct vblock_key, rcu), NULL);
+}
+
+/* Add @key, or rebind it if it already exists. @regions (owned by the
+ * new entry from here on) limits it to those regions; NULL means all.
+ */
+static int vblock_key_add(struct vblock_dev *vd, int key,
+                          unsigned long *regions)
+{
+    struct vblock_key *k, *old;
+    int ret = 0;
+
+    k = kzalloc(sizeof(*k), GFP_KERNEL);
+    if (!k) {
+        bitmap_free(regions);
+        return -ENOMEM;
+    }
+    k->key = key;
+    k->regions = regions;
+
+    mutex_lock(&vd->key_mutex);
+    old = rhashtable_lookup_fast(&vd->keys, &key, vblock_key_params);
+    if (old) {
+        ret = rhashtable_replace_fast(&vd->keys, &old->node, &k->node,
+                                      vblock_key_params);
+        if (!ret)
+            call_rcu(&old->rcu, vblock_key_free_rcu);
+    } else if (atomic_read(&vd->keys.nelems) >= VBLOCK_MAX_KEYS) {
+        ret = -ENOSPC;
+    } else {
+        ret = rhashtable_insert_fast(&vd->keys, &k->node,
+                                     vblock_key_params);
+    }
+    if (!ret)
+        atomic_long_inc(&vd->auth_gen);
+    mutex_unlock(&vd->key_mutex);
+
+    if (ret)
+        vblock_key_free(k, NULL);
+    return ret;
+}
+
+static int vblock_key_revoke(struct vblock_dev *vd, int key)
+{
+    struct vblock_key *k;
+    int ret = -ENOENT;
+
+    mutex_lock(&vd->key_mutex);
+    k = rhashtable_lookup_fast(&vd->keys, &key, vblock_key_params);
+    if (k) {
+        ret = rhashtable_remove_fast(&vd->keys, &k->node,
+                                     vblock_key_params);
+        if (!ret) {
+            atomic_long_inc(&vd->auth_gen);
+            call_rcu(&k->rcu, vblock_key_free_rcu);
         }
+    }
+    mutex_unlock(&vd->key_mutex);
+    return ret;
+}
+
+/* VBLOCK_KEY_ADD: copy in the optional region mask, then add */
+static long vblock_ioctl_key_add(struct vblock_dev *vd, void __user *argp)
+{
+    struct vblock_key_req req;
+    unsigned long *regions = NULL;
+    unsigned int nwords;
+    u64 *words;
 
-        mutex_unlock(&region_mutex[region]);
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
 
-        pos += chunk;
-        done += chunk;
-        remaining -= chunk;
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+
+    if (req.flags & ~VBLOCK_KEY_F_REGIONS)
+        return -EINVAL;
+
+    if (req.flags & VBLOCK_KEY_F_REGIONS) {
+        if (!req.mask_bits || req.mask_bits > vd->num_regions)
+            return -EINVAL;
+
+        nwords = DIV_ROUND_UP(req.mask_bits, 64);
+        words = kcalloc(nwords, sizeof(u64), GFP_KERNEL);
+        regions = bitmap_zalloc(vd->num_regions, GFP_KERNEL);
+        if (!words || !regions) {
+            kfree(words);
+            bitmap_free(regions);
+            return -ENOMEM;
+        }
+
+        if (copy_from_user(words, u64_to_user_ptr(req.mask),
+                           nwords * sizeof(u64))) {
+            kfree(words);
+            bitmap_free(regions);
+            return -EFAULT;
+        }
+        bitmap_from_arr64(regions, words, req.mask_bits);
+        kfree(words);
     }
 
-    *ppos = pos;
+    return vblock_key_add(vd, req.key, regions);
+}
+
+static int vblock_keys_init(struct vblock_dev *vd)
+{
+    int ret, i;
 
-    return done;
+    ret = rhashtable_init(&vd->keys, &vblock_key_params);
+    if (ret)
+        return ret;
+
+    for (i = 0; i < key_count; ++i) {
+        ret = vblock_key_add(vd, user_keys[i], NULL);
+        if (ret) {
+            rhashtable_free_and_destroy(&vd->keys, vblock_key_free, NULL);
+            return ret;
+        }
+    }
+    return 0;
 }
 
-/*
- * Write format when region may be locked:
- *   "<key>:<offset>:<data>"
+static void vblock_keys_exit(struct vblock_dev *vd)
+{
+    /* Replaced and revoked entries may still be waiting for a grace period */
+    rcu_barrier();
+    rhashtable_free_and_destroy(&vd->keys, vblock_key_free, NULL);
+}
+
+/* --- Sessions -------------------------------------------------------
  *
- * If region locked:
- *   - key must be present and must match one of module_param_array user_keys[]
- * If region unlocked:
- *   - key may be omitted by using:
- *       "<offset>:<data>"
+ * VBLOCK_AUTH checks a key once and caches on the file the set of
+ * regions it may write: every unlocked region, plus the locked ones the
+ * key opens. Writes carrying no key of their own then test one bit
+ * instead of parsing and looking up a key.
  *
- * offset is a global byte offset (0..4095).
- * data length must NOT cross region boundary.
+ * The set is stamped with the device's auth_gen, which every key add,
+ * rebind or revoke and every lock or unlock bumps. A write that finds
+ * the stamp stale rebuilds the set from the key store first, or ends
+ * the session if its key is gone. Lock changes happen under the region
+ * mutex, which the writer holds while it checks, so the set is never
+ * stale for the region being written.
  */
-static ssize_t vblock_write(struct file *filp, const char __user *buf,
-                            size_t count, loff_t *ppos)
+
+/* Rebuild @vf's capability set if the device moved on. Caller holds
+ * auth_lock. Returns false if there is no session (any more).
+ */
+static bool session_refresh(struct vblock_dev *vd, struct vblock_file *vf)
 {
-    char *kbuf, *p;
-    char *first, *second;
-    char *data_str;
-    int key = -1;
-    bool key_present = false;
-    unsigned int offset;
-    size_t data_len;
-    int region;
-    int ret;
+    unsigned long gen = atomic_long_read_acquire(&vd->auth_gen);
+    unsigned long *locks = vd->region_lock_bitmap;
+    struct vblock_key *k;
+    unsigned int i;
 
-    if (count == 0)
-        return 0;
+    if (!vf->auth)
+        return false;
+    if (vf->auth_gen == gen)
+        return true;
+
+    rcu_read_lock();
+    k = rhashtable_lookup(&vd->keys, &vf->key, vblock_key_params);
+    if (!k) {
+        rcu_read_unlock();
+        vf->auth = false;
+        return false;
+    }
+
+    /* Word by word, so a writer racing the rebuild on another thread
+     * never sees a half-built word
+     */
+    for (i = 0; i < BITS_TO_LONGS(vd->num_regions); ++i)
+        WRITE_ONCE(vf->caps[i], k->regions ? ~READ_ONCE(locks[i]) |
+                                             k->regions[i] : ~0UL);
+    rcu_read_unlock();
+
+    smp_store_release(&vf->auth_gen, gen);
+    return true;
+}
+
+/* May @vf write @region on the strength of its session? Caller holds
+ * the region mutex.
+ */
+static bool session_may_write(struct vblock_dev *vd, struct vblock_file *vf,
+                              int region)
+{
+    bool ok;
+
+    if (!vf || !READ_ONCE(vf->auth))
+        return false;
+
+    if (smp_load_acquire(&vf->auth_gen) !=
+        atomic_long_read(&vd->auth_gen)) {
+        spin_lock(&vf->auth_lock);
+        ok = session_refresh(vd, vf);
+        spin_unlock(&vf->auth_lock);
+        if (!ok)
+            return false;
+    }
+    return test_bit(region, vf->caps);
+}
+
+/* Start a session for @key on @vf, replacing any previous one; returns
+ * the number of regions it may write, or -EACCES if @key is unknown
+ */
+static int session_start(struct vblock_dev *vd, struct vblock_file *vf,
+                         int key)
+{
+    unsigned long *caps = NULL;
+    int ret;
+
+    if (!vf->caps) {
+        caps = bitmap_alloc(vd->num_regions, GFP_KERNEL);
+        if (!caps)
+            return -ENOMEM;
+    }
+
+    spin_lock(&vf->auth_lock);
+    if (!vf->caps) {
+        vf->caps = caps;
+        caps = NULL;
+    }
+    WRITE_ONCE(vf->auth_gen, 0);
+    vf->key = key;
+    WRITE_ONCE(vf->auth, true);
+    ret = session_refresh(vd, vf) ?
+          bitmap_weight(vf->caps, vd->num_regions) : -EACCES;
+    spin_unlock(&vf->auth_lock);
+
+    bitmap_free(caps);
+    return ret;
+}
+
+static void session_end(struct vblock_file *vf)
+{
+    spin_lock(&vf->auth_lock);
+    WRITE_ONCE(vf->auth, false);
+    spin_unlock(&vf->auth_lock);
+}
+
+/* VBLOCK_AUTH */
+static long vblock_ioctl_auth(struct vblock_dev *vd, struct vblock_file *vf,
+                              void __user *argp)
+{
+    struct vblock_auth req;
+    int ret;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+
+    if (req.flags & ~VBLOCK_AUTH_F_END)
+        return -EINVAL;
+
+    if (req.flags & VBLOCK_AUTH_F_END) {
+        session_end(vf);
+        return 0;
+    }
+
+    ret = session_start(vd, vf, req.key);
+    if (ret < 0)
+        return ret;
+
+    req.regions = ret;
+    return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+/* --- Watches --------------------------------------------------------
+ *
+ * VBLOCK_WATCH gives a file a region mask, and poll() reports EPOLLIN
+ * while a watched region changed (write, erase, discard, restore, lock
+ * or unlock) after the last complete VBLOCK_WATCH_CHANGES.
+ *
+ * Nothing is kept per watcher on the write side. Each region counts
+ * its watchers; while that is non-zero, watch_notify() stamps the
+ * region with the next device-wide watch_seq and wakes the wait queue
+ * of its run of regions. A watcher remembers the watch_seq it has
+ * reported up to and finds its changes by comparing stamps over its
+ * mask. Only watchers sleeping on the same run are woken, and regions
+ * nobody watches cost one atomic_read() per change.
+ */
+
+/* First region from @region on that @vf watches and that changed after
+ * @since, or num_regions
+ */
+static unsigned int watch_next_change(struct vblock_dev *vd,
+                                      struct vblock_file *vf,
+                                      unsigned int region, u64 since)
+{
+    for_each_set_bit_from(region, vf->watch, vd->num_regions)
+        if (READ_ONCE(vd->region_event[region]) > since)
+            break;
+    return region;
+}
+
+static bool watch_pending(struct vblock_dev *vd, struct vblock_file *vf)
+{
+    if (!smp_load_acquire(&vf->watch))
+        return false;
+    return watch_next_change(vd, vf, 0, READ_ONCE(vf->watch_since)) <
+           vd->num_regions;
+}
+
+/* Stop watching; caller holds watch_mutex or is releasing the file */
+static void watch_clear(struct vblock_dev *vd, struct vblock_file *vf)
+{
+    unsigned int region;
+
+    if (!vf->watch)
+        return;
+
+    for_each_set_bit(region, vf->watch, vd->num_regions)
+        atomic_dec(&vd->region_watchers[region]);
+    bitmap_zero(vf->watch, vd->num_regions);
+    WRITE_ONCE(vf->watch_shards, 0);
+}
+
+/* Watch @mask from now on, replacing the old mask */
+static void watch_set(struct vblock_dev *vd, struct vblock_file *vf,
+                      const unsigned long *mask)
+{
+    unsigned int region, start, end, i;
+    u64 shards = 0;
+
+    /* Count the new watchers before dropping the old ones, so a region
+     * in both masks never looks unwatched
+     */
+    for_each_set_bit(region, mask, vd->num_regions)
+        atomic_inc(&vd->region_watchers[region]);
+    watch_clear(vd, vf);
+    bitmap_copy(vf->watch, mask, vd->num_regions);
+
+    for (i = 0; i < VBLOCK_WATCH_SHARDS; ++i) {
+        start = i * vd->watch_span;
+        if (start >= vd->num_regions)
+            break;
+        end = min(start + vd->watch_span, vd->num_regions);
+        if (find_next_bit(mask, end, start) < end)
+            shards |= BIT_ULL(i);
+    }
+    WRITE_ONCE(vf->watch_shards, shards);
+
+    /* Only changes from here on are reported */
+    smp_mb();
+    vf->watch_next = 0;
+    vf->watch_upto = atomic64_read(&vd->watch_seq);
+    WRITE_ONCE(vf->watch_since, vf->watch_upto);
+}
+
+/* VBLOCK_WATCH: copy in the region mask, then watch it */
+static long vblock_ioctl_watch(struct vblock_dev *vd, struct vblock_file *vf,
+                               void __user *argp)
+{
+    struct vblock_watch req;
+    unsigned long *mask, *watch = NULL;
+    u64 *words;
+    unsigned int nwords;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+
+    if (req.flags || req.mask_bits > vd->num_regions)
+        return -EINVAL;
+
+    if (!req.mask_bits) {
+        mutex_lock(&vf->watch_mutex);
+        watch_clear(vd, vf);
+        mutex_unlock(&vf->watch_mutex);
+        return 0;
+    }
+
+    nwords = DIV_ROUND_UP(req.mask_bits, 64);
+    words = kcalloc(nwords, sizeof(u64), GFP_KERNEL);
+    mask = bitmap_zalloc(vd->num_regions, GFP_KERNEL);
+    if (!vf->watch)
+        watch = bitmap_zalloc(vd->num_regions, GFP_KERNEL);
+    if (!words || !mask || (!vf->watch && !watch)) {
+        kfree(words);
+        bitmap_free(mask);
+        bitmap_free(watch);
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(words, u64_to_user_ptr(req.mask),
+                       nwords * sizeof(u64))) {
+        kfree(words);
+        bitmap_free(mask);
+        bitmap_free(watch);
+        return -EFAULT;
+    }
+    bitmap_from_arr64(mask, words, req.mask_bits);
+    kfree(words);
+
+    mutex_lock(&vf->watch_mutex);
+    /* The bitmap stays until release, so poll() never sees it freed */
+    if (!vf->watch) {
+        smp_store_release(&vf->watch, watch);
+        watch = NULL;
+    }
+    watch_set(vd, vf, mask);
+    mutex_unlock(&vf->watch_mutex);
+
+    bitmap_free(watch);
+    bitmap_free(mask);
+    return 0;
+}
+
+/*
+ * VBLOCK_WATCH_CHANGES: report watched regions stamped after
+ * watch_since, in region order. A pass starts by reading watch_seq into
+ * watch_upto, and when it completes that becomes the new watch_since.
+ * A region whose change is still being recorded (pending) is reported
+ * with its new generations; if its stamp lands above watch_upto it is
+ * reported again next pass, which may repeat but never miss a change.
+ */
+static long vblock_ioctl_watch_changes(struct vblock_dev *vd,
+                                       struct vblock_file *vf,
+                                       void __user *argp)
+{
+    struct vblock_changes req;
+    struct vblock_change *buf;
+    unsigned int region, nr = 0;
+    long ret = 0;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+
+    if (!req.max || req.max > VBLOCK_CHANGES_MAX)
+        return -EINVAL;
+
+    buf = kvmalloc_array(req.max, sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    mutex_lock(&vf->watch_mutex);
+    if (!vf->watch || bitmap_empty(vf->watch, vd->num_regions)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    region = vf->watch_next;
+    if (!region) {
+        vf->watch_upto = atomic64_read(&vd->watch_seq);
+        /* Pairs with the ordering in watch_notify() */
+        smp_rmb();
+    }
+
+    while ((region = watch_next_change(vd, vf, region, vf->watch_since)) <
+           vd->num_regions && nr < req.max) {
+        struct vblock_change *c = &buf[nr++];
+
+        smp_rmb();
+        c->region = region;
+        c->locked = region_is_locked(vd, region);
+        c->gen = READ_ONCE(vd->region_gen[region]);
+        c->lock_gen = READ_ONCE(vd->region_meta[region].lock_gen);
+        region++;
+    }
+
+    req.nr = nr;
+    req.flags = region < vd->num_regions ? VBLOCK_CHANGES_F_MORE : 0;
+    req.seq = vf->watch_upto;
+    if (copy_to_user(u64_to_user_ptr(req.entries), buf,
+                     nr * sizeof(*buf)) ||
+        copy_to_user(argp, &req, sizeof(req))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Only move on once the caller has the report */
+    if (req.flags & VBLOCK_CHANGES_F_MORE) {
+        vf->watch_next = region;
+    } else {
+        vf->watch_next = 0;
+        WRITE_ONCE(vf->watch_since, vf->watch_upto);
+    }
+out:
+    mutex_unlock(&vf->watch_mutex);
+    kvfree(buf);
+    return ret;
+}
+
+/* --- Backing store --------------------------------------------------- */
+
+static void store_init(struct vblock_store *s)
+{
+    xa_init(&s->pages);
+    atomic_long_set(&s->nr_pages, 0);
+    s->mapping = NULL;
+}
+
+static void store_free(struct vblock_store *s)
+{
+    struct page *page;
+    unsigned long idx;
+
+    xa_for_each(&s->pages, idx, page)
+        __free_page(page);
+
+    xa_destroy(&s->pages);
+    atomic_long_set(&s->nr_pages, 0);
+}
+
+/* Return the page backing @idx, allocating a zeroed one on first use.
+ * Two regions may share a page, so racing allocators settle it with
+ * xa_cmpxchg() and the loser frees its copy.
+ */
+static struct page *store_get_page(struct vblock_store *s, pgoff_t idx,
+                                   gfp_t gfp)
+{
+    struct page *page, *old;
+
+    page = xa_load(&s->pages, idx);
+    if (page)
+        return page;
+
+    page = alloc_page(gfp | __GFP_ZERO);
+    if (!page)
+        return NULL;
+
+    old = xa_cmpxchg(&s->pages, idx, NULL, page, gfp);
+    if (xa_is_err(old)) {
+        __free_page(page);
+        return NULL;
+    }
+    if (old) {
+        __free_page(page);
+        return old;
+    }
+
+    atomic_long_inc(&s->nr_pages);
+
+    /* The hole may be mapped as the zero page; fault the page in instead */
+    if (READ_ONCE(s->mapping))
+        unmap_mapping_range(s->mapping, (loff_t)idx << PAGE_SHIFT,
+                            PAGE_SIZE, 0);
+    return page;
+}
+
+/* True if no page in [pos, pos + len) has been allocated */
+static bool store_range_empty(struct vblock_store *s, loff_t pos, size_t len)
+{
+    unsigned long idx = pos >> PAGE_SHIFT;
+
+    return !xa_find(&s->pages, &idx, (pos + len - 1) >> PAGE_SHIFT,
+                    XA_PRESENT);
+}
+
+/* Look up a page for a reader that may not hold the region mutex.
+ * Erase, discard, reap, restore and (with compression) freezing free
+ * pages under such a reader, so it takes a reference (dropped by
+ * store_put()) and rechecks the slot, as speculative page cache lookups
+ * do. The reader still retries on the seqcount for consistent data;
+ * the reference only keeps the memory it copies from alive.
+ */
+static struct page *store_lookup(struct vblock_store *s, pgoff_t idx)
+{
+    struct page *page;
+
+    rcu_read_lock();
+repeat:
+    page = xa_load(&s->pages, idx);
+    if (page) {
+        if (!get_page_unless_zero(page))
+            goto repeat;
+        if (unlikely(page != xa_load(&s->pages, idx))) {
+            put_page(page);
+            goto repeat;
+        }
+    }
+    rcu_read_unlock();
+    return page;
+}
+
+static inline void store_put(struct page *page)
+{
+    if (page)
+        put_page(page);
+}
+
+static int store_read_iter(struct vblock_store *s, loff_t pos, size_t len,
+                           struct iov_iter *to)
+{
+    while (len) {
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, len, PAGE_SIZE - off);
+        struct page *page = store_lookup(s, pos >> PAGE_SHIFT);
+        size_t copied;
+
+        if (page)
+            copied = copy_page_to_iter(page, off, n, to);
+        else
+            copied = iov_iter_zero(n, to);
+        store_put(page);
+
+        if (copied != n)
+            return -EFAULT;
+
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void store_read_kernel(struct vblock_store *s, loff_t pos,
+                              void *buf, size_t len)
+{
+    while (len) {
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, len, PAGE_SIZE - off);
+        struct page *page = store_lookup(s, pos >> PAGE_SHIFT);
+
+        if (page)
+            memcpy(buf, page_address(page) + off, n);
+        else
+            memset(buf, 0, n);
+        store_put(page);
+
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Fill [pos, pos + len) from @from. With GFP_NOWAIT a missing page
+ * fails with -EAGAIN instead of blocking in the allocator.
+ */
+static int store_write_iter(struct vblock_store *s, loff_t pos, size_t len,
+                            struct iov_iter *from, gfp_t gfp)
+{
+    while (len) {
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, len, PAGE_SIZE - off);
+        struct page *page = store_get_page(s, pos >> PAGE_SHIFT, gfp);
+
+        if (!page)
+            return gfp == GFP_NOWAIT ? -EAGAIN : -ENOMEM;
+
+        if (copy_page_from_iter(page, off, n, from) != n)
+            return -EFAULT;
+
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Allocate every page of [pos, pos + len) up front, so that writing
+ * the range afterwards cannot fail half-way for want of memory
+ */
+static int store_reserve(struct vblock_store *s, loff_t pos, size_t len,
+                         gfp_t gfp)
+{
+    pgoff_t idx = pos >> PAGE_SHIFT;
+    pgoff_t end = (pos + len - 1) >> PAGE_SHIFT;
+
+    for (; idx <= end; ++idx)
+        if (!store_get_page(s, idx, gfp))
+            return gfp == GFP_NOWAIT ? -EAGAIN : -ENOMEM;
+    return 0;
+}
+
+static int store_write_kernel(struct vblock_store *s, loff_t pos,
+                              const void *buf, size_t len)
+{
+    while (len) {
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, len, PAGE_SIZE - off);
+        struct page *page = store_get_page(s, pos >> PAGE_SHIFT, GFP_KERNEL);
+
+        if (!page)
+            return -ENOMEM;
+
+        memcpy(page_address(page) + off, buf, n);
+
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Zero a range; pages that were never written are already zero */
+static void store_zero(struct vblock_store *s, loff_t pos, size_t len)
+{
+    while (len) {
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, len, PAGE_SIZE - off);
+        struct page *page = xa_load(&s->pages, pos >> PAGE_SHIFT);
+
+        if (page)
+            memset(page_address(page) + off, 0, n);
+
+        pos += n;
+        len -= n;
+    }
+}
+
+/* Free the pages wholly inside [pos, pos + len). Lockless readers may
+ * still hold references (store_lookup()); the last one frees the page.
+ */
+static void store_drop_range(struct vblock_store *s, loff_t pos, size_t len)
+{
+    pgoff_t idx = DIV_ROUND_UP(pos, PAGE_SIZE);
+    pgoff_t end = (pos + len) >> PAGE_SHIFT;
+    struct page *page;
+
+    for (; idx < end; ++idx) {
+        page = xa_erase(&s->pages, idx);
+        if (page) {
+            atomic_long_dec(&s->nr_pages);
+            put_page(page);
+        }
+    }
+}
+
+/* Discard [pos, pos + len): whole pages are freed, partial ones zeroed */
+static void store_discard(struct vblock_store *s, loff_t pos, size_t len)
+{
+    loff_t end = pos + len;
+    loff_t head = min_t(loff_t, round_up(pos, PAGE_SIZE), end);
+    loff_t tail = max_t(loff_t, round_down(end, PAGE_SIZE), head);
+
+    store_zero(s, pos, head - pos);
+    store_drop_range(s, head, tail - head);
+    store_zero(s, tail, end - tail);
+}
+
+/* Make dst match src over [pos, pos + len) */
+static int store_copy(struct vblock_store *dst, struct vblock_store *src,
+                      loff_t pos, size_t len, gfp_t gfp)
+{
+    while (len) {
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, len, PAGE_SIZE - off);
+        struct page *spage = xa_load(&src->pages, pos >> PAGE_SHIFT);
+
+        if (spage) {
+            struct page *dpage = store_get_page(dst, pos >> PAGE_SHIFT, gfp);
+
+            if (!dpage)
+                return gfp == GFP_NOWAIT ? -EAGAIN : -ENOMEM;
+            memcpy(page_address(dpage) + off, page_address(spage) + off, n);
+        } else {
+            store_zero(dst, pos, n);
+        }
+
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* --- Region access --------------------------------------------------- */
+
+/* Writers to a region's data or mirror hold its mutex and bump its
+ * sequence count. Plain seqcount_t with the raw writer API, because a
+ * seqcount_mutex_t writer section disables preemption and ours sleep.
+ * The section also holds snap_freeze shared; see vblock_snapshot_create().
+ */
+static inline void region_write_begin(struct vblock_dev *vd, int region)
+{
+    percpu_down_read(&vd->snap_freeze);
+    region_lock(vd, region);
+    raw_write_seqcount_begin(&vd->region_seq[region]);
+}
+
+/* IOCB_NOWAIT variant: fails instead of sleeping on a contended mutex */
+static inline bool region_write_trylock(struct vblock_dev *vd, int region)
+{
+    if (!percpu_down_read_trylock(&vd->snap_freeze))
+        return false;
+    if (!mutex_trylock(&vd->region_mutex[region])) {
+        percpu_up_read(&vd->snap_freeze);
+        return false;
+    }
+    raw_write_seqcount_begin(&vd->region_seq[region]);
+    return true;
+}
+
+/* Record a change to a region's data; call inside its writer section */
+static inline void region_changed(struct vblock_dev *vd, int region)
+{
+    WRITE_ONCE(vd->region_gen[region], vd->region_gen[region] + 1);
+    set_bit(region, vd->backup_dirty);
+    clear_bit(region, vd->region_csum_valid);
+    watch_notify(vd, region);
+}
+
+/* Preserve a region for the snapshot before its first change since
+ * the snapshot was taken. Writers call this inside their section;
+ * mmap calls it before a new writable mapping can store to the region.
+ * With GFP_NOWAIT it fails with -EAGAIN rather than block.
+ */
+static int region_cow(struct vblock_dev *vd, int region, gfp_t gfp)
+{
+    int ret = 0;
+
+    if (!READ_ONCE(vd->snap_active) ||
+        test_bit_acquire(region, vd->snap_preserved))
+        return 0;
+
+    if (gfp != GFP_NOWAIT)
+        mutex_lock(&vd->snap_mutex);
+    else if (!mutex_trylock(&vd->snap_mutex))
+        return -EAGAIN;
+
+    if (vd->snap_active && !test_bit(region, vd->snap_preserved)) {
+        ret = store_copy(&vd->snap, &vd->data, region_start(vd, region),
+                         vd->region_size, gfp);
+        if (!ret) {
+            /* Pairs with test_bit_acquire() in region_src() */
+            smp_mb__before_atomic();
+            set_bit(region, vd->snap_preserved);
+        }
+    }
+
+    mutex_unlock(&vd->snap_mutex);
+    return ret;
+}
+
+static inline void region_write_end(struct vblock_dev *vd, int region)
+{
+    raw_write_seqcount_end(&vd->region_seq[region]);
+    mutex_unlock(&vd->region_mutex[region]);
+    percpu_up_read(&vd->snap_freeze);
+}
+
+/* The store to read @region from: @s itself, or for a NULL @s the
+ * snapshot view. Snapshot readers hold snap_rwsem shared and
+ * choose the store anew on every pass, since a writer that overlaps the
+ * read preserves the region before changing it.
+ */
+static inline struct vblock_store *region_src(struct vblock_dev *vd,
+                                              struct vblock_store *s,
+                                              int region)
+{
+    if (s)
+        return s;
+    return test_bit_acquire(region, vd->snap_preserved) ? &vd->snap
+                                                    : &vd->data;
+}
+
+/*
+ * Copy [pos, pos + len) of one region into @to without taking its mutex.
+ * A reader that finds a writer inside its section, or is overlapped
+ * VBLOCK_SEQ_RETRIES times, takes the mutex instead of spinning, since
+ * the writer may be asleep. With @nowait that fallback only trylocks
+ * and returns -EAGAIN if the writer still holds the region.
+ * If @gen is set it receives the generation matching the copied data.
+ * A NULL @s reads the snapshot view (see region_src()). A cold or
+ * erased region is thawed first. On a fault @to is left advanced by
+ * what was copied, and only a consistent prefix is ever kept.
+ */
+static int __region_read_iter(struct vblock_dev *vd, struct vblock_store *s,
+                              int region, loff_t pos, size_t len,
+                              struct iov_iter *to, bool nowait, u64 *gen)
+{
+    unsigned int seq;
+    size_t left;
+    int tries, ret;
+
+    for (tries = 0; tries < VBLOCK_SEQ_RETRIES; ++tries) {
+        ret = region_thaw(vd, region, nowait);
+        if (ret)
+            return ret;
+
+        seq = raw_read_seqcount(&vd->region_seq[region]);
+        if (seq & 1)
+            break;
+
+        /* Frozen or erased again since the thaw above */
+        if (region_needs_thaw(vd, region))
+            continue;
+
+        if (gen)
+            *gen = READ_ONCE(vd->region_gen[region]);
+
+        left = iov_iter_count(to);
+        ret = store_read_iter(region_src(vd, s, region), pos, len, to);
+        if (!read_seqcount_retry(&vd->region_seq[region], seq))
+            return ret;
+
+        iov_iter_revert(to, left - iov_iter_count(to));
+    }
+
+    if (!nowait)
+        region_lock(vd, region);
+    else if (!mutex_trylock(&vd->region_mutex[region]))
+        return -EAGAIN;
+
+    ret = __region_thaw(vd, region, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!ret) {
+        if (gen)
+            *gen = vd->region_gen[region];
+        ret = store_read_iter(region_src(vd, s, region), pos, len, to);
+    }
+    mutex_unlock(&vd->region_mutex[region]);
+    return ret;
+}
+
+static int region_read_iter(struct vblock_dev *vd, struct vblock_store *s,
+                            int region, loff_t pos, size_t len,
+                            struct iov_iter *to, bool nowait, u64 *gen)
+{
+    u64 t0 = local_clock();
+    int ret;
+
+    ret = __region_read_iter(vd, s, region, pos, len, to, nowait, gen);
+    if (!ret) {
+        region_stat_io(vd, region, false, len);
+        lat_record(vd, VBLOCK_LAT_READ, t0);
+    }
+    trace_vblock_read(vd->id, region, pos, len, nowait, ret, t0);
+    return ret;
+}
+
+static int region_read_kernel(struct vblock_dev *vd, struct vblock_store *s,
+                              int region, loff_t pos, void *buf, size_t len)
+{
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+    return region_read_iter(vd, s, region, pos, len, &iter, false, NULL);
+}
+
+/* --- Mirror ---------------------------------------------------------
+ *
+ * By default writers copy each change into the mirror inside their own
+ * section. With mirror_async they only mark the region in mirror_dirty,
+ * and mirror_work copies every dirty region in one pass after
+ * mirror_batch_ms, so repeated writes to a region cost one copy.
+ * Mirror reads and VBLOCK_MIRROR_FLUSH call vblock_mirror_sync() to
+ * catch up first.
+ */
+
+static void mirror_mark(struct vblock_dev *vd, int region)
+{
+    if (!test_and_set_bit(region, vd->mirror_dirty)) {
+        WRITE_ONCE(vd->mirror_since[region], ktime_get_ns());
+        queue_delayed_work(system_unbound_wq, &vd->mirror_work,
+                           msecs_to_jiffies(READ_ONCE(mirror_batch_ms)));
+    }
+}
+
+/* Propagate a change to [pos, pos + len) of @region, inside its writer
+ * section: copied now, or left to the worker in mirror_async mode.
+ */
+static int region_mirror(struct vblock_dev *vd, int region, loff_t pos,
+                         size_t len, gfp_t gfp)
+{
+    if (!mirror_enable)
+        return 0;
+
+    if (!READ_ONCE(mirror_async)) {
+        u64 t0 = trace_vblock_mirror_copy_enabled() ? local_clock() : 0;
+        int ret = store_copy(&vd->mirror, &vd->data, pos, len, gfp);
+
+        trace_vblock_mirror_copy(vd->id, region, pos, len, ret, t0);
+        return ret;
+    }
+
+    WRITE_ONCE(vd->mirror_pending[region],
+               min_t(u64, vd->mirror_pending[region] + len, vd->region_size));
+    mirror_mark(vd, region);
+    return 0;
+}
+
+/* Bring one region of the mirror up to date; false if it already was.
+ * The bit is cleared before the copy, so a write that lands meanwhile
+ * marks the region again rather than being lost.
+ */
+static bool vblock_mirror_sync(struct vblock_dev *vd, int region)
+{
+    u64 t0;
+    int ret;
+
+    if (!mirror_enable)
+        return false;
+
+    if (!test_and_clear_bit(region, vd->mirror_dirty) &&
+        !region_mmap_dirty(vd, region))
+        return false;
+
+    region_write_begin(vd, region);
+    t0 = trace_vblock_mirror_copy_enabled() ? local_clock() : 0;
+    ret = __region_thaw(vd, region, GFP_KERNEL);
+    if (!ret)
+        ret = store_copy(&vd->mirror, &vd->data, region_start(vd, region),
+                         vd->region_size, GFP_KERNEL);
+    if (!ret)
+        WRITE_ONCE(vd->mirror_pending[region], 0);
+    trace_vblock_mirror_copy(vd->id, region, region_start(vd, region),
+                             vd->region_size, ret, t0);
+    region_write_end(vd, region);
+
+    if (ret) {
+        pr_warn_ratelimited("vblock%d: mirror sync of region %d failed\n",
+                            vd->id, region);
+        mirror_mark(vd, region);
+        return false;
+    }
+
+    atomic64_inc(&vd->mirror_synced);
+    return true;
+}
+
+static void vblock_mirror_fn(struct work_struct *work)
+{
+    struct vblock_dev *vd = container_of(to_delayed_work(work),
+                                         struct vblock_dev, mirror_work);
+    bool any = false;
+    int i;
+
+    for_each_set_bit(i, vd->mirror_dirty, vd->num_regions)
+        any |= vblock_mirror_sync(vd, i);
+
+    if (any)
+        atomic64_inc(&vd->mirror_batches);
+}
+
+/* Mirror everything written before the call */
+static void vblock_mirror_flush(struct vblock_dev *vd)
+{
+    int i;
+
+    for (i = 0; i < vd->num_regions; ++i)
+        vblock_mirror_sync(vd, i);
+}
+
+static void vblock_mirror_get_stat(struct vblock_dev *vd,
+                                   struct vblock_mirror_stat *st)
+{
+    u64 now = ktime_get_ns();
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    st->async = READ_ONCE(mirror_async);
+    st->batches = atomic64_read(&vd->mirror_batches);
+    st->regions_synced = atomic64_read(&vd->mirror_synced);
+
+    for_each_set_bit(i, vd->mirror_dirty, vd->num_regions) {
+        u64 since = READ_ONCE(vd->mirror_since[i]);
+
+        st->regions_pending++;
+        st->bytes_pending += READ_ONCE(vd->mirror_pending[i]);
+        if (now > since)
+            st->oldest_ns = max(st->oldest_ns, now - since);
+    }
+}
+
+/* Lock regions [first, last] for writing as one unit; see
+ * span_mutex. A single region takes the plain writer section.
+ */
+static void span_write_begin(struct vblock_dev *vd, int first, int last)
+{
+    int i;
+
+    if (first == last) {
+        region_write_begin(vd, first);
+        return;
+    }
+
+    percpu_down_read(&vd->snap_freeze);
+    mutex_lock(&vd->span_mutex);
+    for (i = first; i <= last; ++i) {
+        mutex_lock_nest_lock(&vd->region_mutex[i], &vd->span_mutex);
+        raw_write_seqcount_begin(&vd->region_seq[i]);
+    }
+    raw_write_seqcount_begin(&vd->span_seq);
+}
+
+static void span_write_end(struct vblock_dev *vd, int first, int last)
+{
+    int i;
+
+    if (first == last) {
+        region_write_end(vd, first);
+        return;
+    }
+
+    raw_write_seqcount_end(&vd->span_seq);
+    for (i = last; i >= first; --i) {
+        raw_write_seqcount_end(&vd->region_seq[i]);
+        mutex_unlock(&vd->region_mutex[i]);
+    }
+    mutex_unlock(&vd->span_mutex);
+    percpu_up_read(&vd->snap_freeze);
+}
+
+/* Copy [pos, pos + len) region by region into @to */
+static int read_regions(struct vblock_dev *vd, loff_t pos, size_t len,
+                        struct iov_iter *to, bool nowait)
+{
+    while (len) {
+        int region = pos / vd->region_size;
+        size_t chunk = min_t(u64, len,
+                             region_start(vd, region) + vd->region_size - pos);
+        int ret;
+
+        ret = __region_read_iter(vd, &vd->data, region, pos, chunk, to,
+                                 nowait, NULL);
+        if (ret)
+            return ret;
+
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Account a finished span_read_iter() once, whatever it took to get a
+ * consistent copy: per-region bytes, one latency sample, and a read
+ * event per region
+ */
+static void read_regions_done(struct vblock_dev *vd, loff_t pos, size_t len,
+                              bool nowait, int ret, u64 t0)
+{
+    if (!ret)
+        lat_record(vd, VBLOCK_LAT_READ, t0);
+
+    while (len) {
+        int region = pos / vd->region_size;
+        size_t chunk = min_t(u64, len,
+                             region_start(vd, region) + vd->region_size - pos);
+
+        if (!ret)
+            region_stat_io(vd, region, false, chunk);
+        trace_vblock_read(vd->id, region, pos, chunk, nowait, ret, t0);
+
+        pos += chunk;
+        len -= chunk;
+    }
+}
+
+/*
+ * Read a range crossing regions so that no multi-region write is seen
+ * half done: each region is consistent on its own through its seqcount,
+ * and span_seq catches a spanning write landing between two of
+ * them. Falls back to span_mutex like region_read_iter() does
+ * to the region mutex.
+ */
+static int span_read_iter(struct vblock_dev *vd, loff_t pos, size_t len,
+                          struct iov_iter *to, bool nowait)
+{
+    u64 t0 = local_clock();
+    unsigned int seq;
+    size_t left;
+    int tries, ret;
+
+    for (tries = 0; tries < VBLOCK_SEQ_RETRIES; ++tries) {
+        seq = raw_read_seqcount(&vd->span_seq);
+        if (seq & 1)
+            break;
+
+        left = iov_iter_count(to);
+        ret = read_regions(vd, pos, len, to, nowait);
+        if (!read_seqcount_retry(&vd->span_seq, seq))
+            goto out;
+
+        iov_iter_revert(to, left - iov_iter_count(to));
+    }
+
+    if (!nowait) {
+        mutex_lock(&vd->span_mutex);
+    } else if (!mutex_trylock(&vd->span_mutex)) {
+        ret = -EAGAIN;
+        goto out;
+    }
+
+    ret = read_regions(vd, pos, len, to, nowait);
+    mutex_unlock(&vd->span_mutex);
+out:
+    read_regions_done(vd, pos, len, nowait, ret, t0);
+    return ret;
+}
+
+/* Write to the data store and, if enabled, the mirror.
+ * Caller holds region_mutex for @region, which holds the whole range.
+ */
+static int vblock_store_write(struct vblock_dev *vd, int region, loff_t pos,
+                              const void *buf, size_t len)
+{
+    int ret;
+
+    ret = store_write_kernel(&vd->data, pos, buf, len);
+    if (!ret)
+        ret = region_mirror(vd, region, pos, len, GFP_KERNEL);
+    return ret;
+}
+
+/* --- Checksums ------------------------------------------------------
+ *
+ * With csum=1 a backup records the CRC32C of each region it copies that
+ * has none, and checks it against those that have one; csum=2 does the
+ * same for VBLOCK_READ_REGION(_BUF) of the data. A write drops the sum,
+ * so the cost is one checksum per region per backup, folded into the
+ * copy. A mismatch means the data changed behind the writers' backs:
+ * the region is copied back from the mirror if that still matches the
+ * sum, and the caller gets -EIO otherwise. crc32c() uses the CPU's
+ * CRC32 instruction where there is one.
+ *
+ * A sum is only recorded or checked if the region is unchanged since
+ * its data was read: region_csum_stamp() is taken before the read and
+ * compared under region_mutex and map_lock. Stores through a
+ * mapping bump no generation, so mapped-writable regions are skipped
+ * and unmapping them bumps wmap_epoch.
+ */
+
+static inline u64 region_csum_stamp(struct vblock_dev *vd, int region)
+{
+    return READ_ONCE(vd->region_gen[region]) + READ_ONCE(vd->wmap_epoch);
+}
+
+/* Extend @crc over @len zero bytes */
+static u32 csum_zeros(u32 crc, size_t len)
+{
+    while (len) {
+        size_t n = min_t(size_t, len, PAGE_SIZE);
+
+        crc = crc32c(crc, page_address(ZERO_PAGE(0)), n);
+        len -= n;
+    }
+    return crc;
+}
+
+/* CRC32C of [pos, pos + len) of @s, holes reading as zeros */
+static u32 store_csum(struct vblock_store *s, loff_t pos, size_t len)
+{
+    u32 crc = ~0U;
+
+    while (len) {
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, len, PAGE_SIZE - off);
+        struct page *page = xa_load(&s->pages, pos >> PAGE_SHIFT);
+
+        if (page)
+            crc = crc32c(crc, page_address(page) + off, n);
+        else
+            crc = csum_zeros(crc, n);
+
+        pos += n;
+        len -= n;
+    }
+    return crc;
+}
+
+/* Copy @region back from the mirror if the mirror matches its sum;
+ * -EAGAIN when done, as the caller's copy of the data is bad. Caller
+ * holds region_mutex.
+ */
+static int region_repair(struct vblock_dev *vd, int region)
+{
+    loff_t start = region_start(vd, region);
+    int ret;
+
+    if (!mirror_enable ||
+        store_csum(&vd->mirror, start, vd->region_size) !=
+        vd->region_csum[region]) {
+        pr_err_ratelimited("vblock%d: region %d fails its checksum\n",
+                           vd->id, region);
+        return -EIO;
+    }
+
+    ret = __region_thaw(vd, region, GFP_KERNEL);
+    if (ret)
+        return ret;
+
+    raw_write_seqcount_begin(&vd->region_seq[region]);
+    ret = store_copy(&vd->data, &vd->mirror, start, vd->region_size,
+                     GFP_KERNEL);
+    raw_write_seqcount_end(&vd->region_seq[region]);
+    if (ret)
+        return ret;
+
+    region_stat_add(vd, region, RSTAT_REPAIRS, 1);
+    pr_warn_ratelimited("vblock%d: region %d failed its checksum, repaired from the mirror\n",
+                        vd->id, region);
+    return -EAGAIN;
+}
+
+/* Record @crc, the sum of @region's data as read after @stamp was
+ * taken, if the region has none, or check it against the recorded one.
+ * Caller holds region_mutex.
+ */
+static int __region_csum_check(struct vblock_dev *vd, int region, u64 stamp,
+                               u32 crc)
+{
+    bool match;
+
+    spin_lock(&vd->map_lock);
+    if (region_csum_stamp(vd, region) != stamp || vd->region_wmaps[region]) {
+        spin_unlock(&vd->map_lock);
+        return 0;
+    }
+    if (!test_bit(region, vd->region_csum_valid)) {
+        vd->region_csum[region] = crc;
+        set_bit(region, vd->region_csum_valid);
+    }
+    match = vd->region_csum[region] == crc;
+    spin_unlock(&vd->map_lock);
+
+    if (match)
+        return 0;
+
+    region_stat_add(vd, region, RSTAT_CSUM_ERRORS, 1);
+    return region_repair(vd, region);
+}
+
+/* Check @region's data before a csum=2 read; a repaired region is
+ * good to read.
+ */
+static int region_verify(struct vblock_dev *vd, int region)
+{
+    u64 stamp;
+    u32 crc;
+    int ret;
+
+    region_lock(vd, region);
+    ret = __region_thaw(vd, region, GFP_KERNEL);
+    if (!ret) {
+        stamp = region_csum_stamp(vd, region);
+        crc = store_csum(&vd->data, region_start(vd, region),
+                         vd->region_size);
+        ret = __region_csum_check(vd, region, stamp, crc);
+    }
+    mutex_unlock(&vd->region_mutex[region]);
+
+    return ret == -EAGAIN ? 0 : ret;
+}
+
+/* --- Discard --------------------------------------------------------
+ *
+ * Erasing a whole region is O(1) whatever its size: inside the writer
+ * section it bumps the region's generation and sets its region_erased
+ * bit, and from then on the stores are stale. Readers thaw the region
+ * (see region_needs_thaw()), which frees its data and mirror pages, and
+ * so does the first writer; reap_work frees the rest soon after.
+ *
+ * Pages that are mapped into user space can't be freed, so erase and
+ * discard zero in place while any mapping exists. The erased bit, set
+ * before nr_maps is checked, keeps new mappings out meanwhile.
+ */
+
+/* Free the memory of a lazily erased region; caller holds its mutex.
+ * Runs inside a writer section, entering one if the caller (say a
+ * reader thawing the region) is not in one already, so lockless
+ * readers that raced with it retry.
+ */
+static void region_reap(struct vblock_dev *vd, int region)
+{
+    loff_t start = region_start(vd, region);
+    /* Odd only inside our own section: writers hold the mutex */
+    bool section = raw_read_seqcount(&vd->region_seq[region]) & 1;
+
+    if (!section)
+        raw_write_seqcount_begin(&vd->region_seq[region]);
+
+    store_discard(&vd->data, start, vd->region_size);
+    store_discard(&vd->mirror, start, vd->region_size);
+
+    if (vblock_compress && test_bit(region, vd->region_cold)) {
+        struct vblock_zregion *z = &vd->region_z[region];
+
+        atomic64_sub(z->zlen, &vd->z_bytes);
+        kvfree(z->zbuf);
+        z->zbuf = NULL;
+        z->zlen = 0;
+        clear_bit(region, vd->region_cold);
+    }
+
+    /* Stores first, then the bit; pairs with region_needs_thaw() */
+    smp_mb__before_atomic();
+    clear_bit(region, vd->region_erased);
+
+    if (!section)
+        raw_write_seqcount_end(&vd->region_seq[region]);
+}
+
+static void vblock_reap_fn(struct work_struct *work)
+{
+    struct vblock_dev *vd = container_of(work, struct vblock_dev, reap_work);
+    int region;
+
+    for_each_set_bit(region, vd->region_erased, vd->num_regions) {
+        mutex_lock(&vd->region_mutex[region]);
+        if (test_bit(region, vd->region_erased))
+            region_reap(vd, region);
+        mutex_unlock(&vd->region_mutex[region]);
+        cond_resched();
+    }
+}
+
+/* Fence off new mappings of @region; true if the device is mapped and
+ * its pages must be kept. Pairs with vblock_mmap().
+ */
+static bool region_fence_maps(struct vblock_dev *vd, int region)
+{
+    set_bit(region, vd->region_erased);
+    smp_mb__after_atomic();
+    return atomic_read(&vd->nr_maps);
+}
+
+/* Erase all of @region; call inside its writer section */
+static int region_erase(struct vblock_dev *vd, int region)
+{
+    loff_t start = region_start(vd, region);
+    int ret;
+
+    /* The snapshot still needs the old contents */
+    if (READ_ONCE(vd->snap_active)) {
+        ret = __region_thaw(vd, region, GFP_KERNEL);
+        if (!ret)
+            ret = region_cow(vd, region, GFP_KERNEL);
+        if (ret)
+            return ret;
+    }
+
+    if (region_fence_maps(vd, region)) {
+        store_zero(&vd->data, start, vd->region_size);
+        store_zero(&vd->mirror, start, vd->region_size);
+        clear_bit(region, vd->region_erased);
+    } else {
+        queue_work(system_unbound_wq, &vd->reap_work);
+    }
+
+    region_changed(vd, region);
+    region_stat_add(vd, region, RSTAT_ERASES, 1);
+    return 0;
+}
+
+/* Discard part of @region; call inside its writer section */
+static int region_discard(struct vblock_dev *vd, int region, loff_t pos,
+                          size_t len)
+{
+    int ret;
+
+    ret = __region_thaw(vd, region, GFP_KERNEL);
+    if (!ret)
+        ret = region_cow(vd, region, GFP_KERNEL);
+    if (ret)
+        return ret;
+
+    /* The erased bit only fences mmap here: we hold the mutex and are
+     * inside the writer section, so no reader or reaper sees it.
+     */
+    if (region_fence_maps(vd, region))
+        store_zero(&vd->data, pos, len);
+    else
+        store_discard(&vd->data, pos, len);
+    clear_bit(region, vd->region_erased);
+
+    ret = region_mirror(vd, region, pos, len, GFP_KERNEL);
+    region_changed(vd, region);
+    region_stat_add(vd, region, RSTAT_ERASES, 1);
+    return ret;
+}
+
+/*
+ * Discard [pos, pos + len): afterwards it reads as zeros, and whole
+ * regions inside it are erased in O(1). Regions are done one at a time;
+ * on error (-EACCES for a locked region @vf's session doesn't open) the
+ * ones before it are already discarded.
+ */
+static int vblock_discard(struct vblock_dev *vd, loff_t pos, size_t len,
+                          struct vblock_file *vf)
+{
+    loff_t end = pos + len;
+    int ret = 0;
+
+    while (pos < end && !ret) {
+        int region = pos / vd->region_size;
+        loff_t rstart = region_start(vd, region);
+        loff_t rend = min_t(loff_t, end, rstart + vd->region_size);
+
+        region_write_begin(vd, region);
+        if (!region_may_write(vd, region, vf, false, 0))
+            ret = -EACCES;
+        else if (pos == rstart && rend - rstart == vd->region_size)
+            ret = region_erase(vd, region);
+        else
+            ret = region_discard(vd, region, pos, rend - pos);
+        region_write_end(vd, region);
+
+        pos = rend;
+        cond_resched();
+    }
+    return ret;
+}
+
+/* --- Compression ----------------------------------------------------
+ *
+ * With compress=1 at most hot_regions regions keep their data in pages.
+ * Beyond that, compress_work freezes the least recently used:
+ * inside a writer section it LZ4-compresses the region, drops its pages
+ * and sets its cold bit. Any access thaws it again under the region
+ * mutex. Lockless readers look pages up with a reference (see
+ * store_lookup()) and retry on the seqcount, so a freeze racing with
+ * them is harmless. Only the data store is compressed.
+ */
+
+static void region_touch(struct vblock_dev *vd, int region)
+{
+    if (!vblock_compress)
+        return;
+
+    this_cpu_inc(*vd->z_accesses);
+    if (!test_bit(region, vd->region_ref))
+        set_bit(region, vd->region_ref);
+}
+
+/* Put a resident region on the LRU and kick the evictor if over budget */
+static void region_make_hot(struct vblock_dev *vd, int region)
+{
+    struct vblock_zregion *z = &vd->region_z[region];
+    bool over;
+
+    if (!list_empty_careful(&z->lru))
+        return;
+
+    spin_lock(&vd->lru_lock);
+    if (list_empty(&z->lru)) {
+        list_add(&z->lru, &vd->hot_lru);
+        vd->nr_hot++;
+    }
+    over = vd->nr_hot > READ_ONCE(hot_regions);
+    spin_unlock(&vd->lru_lock);
+
+    if (over)
+        queue_work(system_unbound_wq, &vd->compress_work);
+}
+
+/*
+ * Make a region's stores hold its contents before they are used under
+ * the region mutex (held by the caller): free the pages of a lazily
+ * erased region and decompress a cold one. Writers call this inside
+ * their section; with GFP_NOWAIT a cold region fails with -EAGAIN.
+ */
+static int __region_thaw(struct vblock_dev *vd, int region, gfp_t gfp)
+{
+    struct vblock_zregion *z;
+    loff_t start = region_start(vd, region);
+    unsigned int off;
+    void *buf;
+    int ret = 0;
+
+    if (test_bit(region, vd->region_erased))
+        region_reap(vd, region);
+
+    if (!vblock_compress)
+        return 0;
+
+    region_touch(vd, region);
+    z = &vd->region_z[region];
+
+    if (!test_bit(region, vd->region_cold)) {
+        region_make_hot(vd, region);
+        return 0;
+    }
+    if (gfp == GFP_NOWAIT)
+        return -EAGAIN;
+
+    buf = kvmalloc(vd->region_size, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    if (LZ4_decompress_safe(z->zbuf, buf, z->zlen, vd->region_size) !=
+        vd->region_size) {
+        pr_err_ratelimited("vblock%d: region %d failed to decompress\n",
+                           vd->id, region);
+        ret = -EIO;
+        goto out;
+    }
+
+    /* Pages that were holes stay holes */
+    for (off = 0; off < vd->region_size && !ret; off += PAGE_SIZE)
+        if (memchr_inv(buf + off, 0, PAGE_SIZE))
+            ret = store_write_kernel(&vd->data, start + off, buf + off,
+                                     PAGE_SIZE);
+    if (ret) {
+        /* Still cold: drop what was inserted, the compressed copy stands */
+        store_drop_range(&vd->data, start, vd->region_size);
+        goto out;
+    }
+
+    atomic64_sub(z->zlen, &vd->z_bytes);
+    kvfree(z->zbuf);
+    z->zbuf = NULL;
+    z->zlen = 0;
+
+    /* Pages first, then the bit; pairs with region_is_cold() */
+    smp_mb__before_atomic();
+    clear_bit(region, vd->region_cold);
+    atomic64_inc(&vd->z_thaws);
+    region_make_hot(vd, region);
+out:
+    kvfree(buf);
+    return ret;
+}
+
+static int region_thaw(struct vblock_dev *vd, int region, bool nowait)
+{
+    int ret;
+
+    if (!region_needs_thaw(vd, region)) {
+        region_touch(vd, region);
+        return 0;
+    }
+
+    if (!nowait)
+        region_lock(vd, region);
+    else if (!mutex_trylock(&vd->region_mutex[region]))
+        return -EAGAIN;
+
+    ret = __region_thaw(vd, region, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    mutex_unlock(&vd->region_mutex[region]);
+    return ret;
+}
+
+/* Compress one resident region and free its pages. Returns false if it
+ * is not worth keeping compressed (or could not be), leaving it as is.
+ */
+static bool region_freeze(struct vblock_dev *vd, int region)
+{
+    struct vblock_zregion *z = &vd->region_z[region];
+    loff_t start = region_start(vd, region);
+    bool frozen = false;
+    void *zbuf;
+    int zlen;
+
+    region_write_begin(vd, region);
+
+    if (test_bit(region, vd->region_cold) ||
+        test_bit(region, vd->region_erased) ||
+        store_range_empty(&vd->data, start, vd->region_size))
+        goto out;
+
+    store_read_kernel(&vd->data, start, vd->z_src, vd->region_size);
+    zlen = LZ4_compress_default(vd->z_src, vd->z_dst, vd->region_size,
+                                LZ4_compressBound(vd->region_size),
+                                vd->z_wrkmem);
+
+    /* Less than 1/8 saved isn't worth a decompression per access */
+    if (zlen <= 0 || zlen > vd->region_size - vd->region_size / 8) {
+        atomic64_inc(&vd->z_rejects);
+        goto out;
+    }
+
+    zbuf = kvmalloc(zlen, GFP_KERNEL);
+    if (!zbuf)
+        goto out;
+    memcpy(zbuf, vd->z_dst, zlen);
+
+    z->zbuf = zbuf;
+    z->zlen = zlen;
+    atomic64_add(zlen, &vd->z_bytes);
+    set_bit(region, vd->region_cold);
+    store_drop_range(&vd->data, start, vd->region_size);
+    atomic64_inc(&vd->z_freezes);
+    frozen = true;
+out:
+    region_write_end(vd, region);
+    return frozen;
+}
+
+/* Evict from the LRU tail until within hot_regions. Regions used since
+ * the last pass get a second chance; each region is looked at no more
+ * than twice per run, so incompressible ones can't keep it spinning.
+ */
+static void vblock_compress_fn(struct work_struct *work)
+{
+    struct vblock_dev *vd = container_of(work, struct vblock_dev,
+                                         compress_work);
+    unsigned int budget;
+    int region;
+
+    spin_lock(&vd->lru_lock);
+    budget = 2 * vd->nr_hot;
+
+    while (budget-- && vd->nr_hot > READ_ONCE(hot_regions)) {
+        struct vblock_zregion *z;
+
+        z = list_last_entry(&vd->hot_lru, struct vblock_zregion, lru);
+        region = z - vd->region_z;
+
+        if (test_and_clear_bit(region, vd->region_ref)) {
+            list_move(&z->lru, &vd->hot_lru);
+            continue;
+        }
+
+        list_del_init(&z->lru);
+        vd->nr_hot--;
+        spin_unlock(&vd->lru_lock);
+
+        if (!region_freeze(vd, region)) {
+            /* Holes or incompressible: still resident unless empty */
+            if (!store_range_empty(&vd->data, region_start(vd, region),
+                                   vd->region_size))
+                region_make_hot(vd, region);
+        }
+
+        cond_resched();
+        spin_lock(&vd->lru_lock);
+    }
+    spin_unlock(&vd->lru_lock);
+}
+
+static void vblock_compress_get_stat(struct vblock_dev *vd,
+                                     struct vblock_compress_stat *st)
+{
+    int cpu;
+
+    memset(st, 0, sizeof(*st));
+    st->enabled = vblock_compress;
+    if (!vblock_compress)
+        return;
+
+    st->hot_limit = READ_ONCE(hot_regions);
+    st->hot_regions = READ_ONCE(vd->nr_hot);
+    st->cold_regions = bitmap_weight(vd->region_cold, vd->num_regions);
+    st->raw_bytes = (u64)st->cold_regions * vd->region_size;
+    st->compressed_bytes = atomic64_read(&vd->z_bytes);
+    st->thaws = atomic64_read(&vd->z_thaws);
+    st->freezes = atomic64_read(&vd->z_freezes);
+    st->rejects = atomic64_read(&vd->z_rejects);
+    for_each_possible_cpu(cpu)
+        st->accesses += *per_cpu_ptr(vd->z_accesses, cpu);
+}
+
+static int vblock_compress_init(struct vblock_dev *vd)
+{
+    if (!vblock_compress)
+        return 0;
+
+    if (vd->region_size % PAGE_SIZE) {
+        pr_err("vblock%d: compress needs region_size to be a multiple of %lu\n",
+               vd->id, PAGE_SIZE);
+        return -EINVAL;
+    }
+
+    vd->z_src = kvmalloc(vd->region_size, GFP_KERNEL);
+    vd->z_dst = kvmalloc(LZ4_compressBound(vd->region_size), GFP_KERNEL);
+    vd->z_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    if (!vd->z_src || !vd->z_dst || !vd->z_wrkmem) {
+        kvfree(vd->z_src);
+        kvfree(vd->z_dst);
+        kvfree(vd->z_wrkmem);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void vblock_compress_exit(struct vblock_dev *vd)
+{
+    int i;
+
+    if (!vblock_compress)
+        return;
+
+    cancel_work_sync(&vd->compress_work);
+    for (i = 0; i < vd->num_regions; ++i)
+        kvfree(vd->region_z[i].zbuf);
+
+    kvfree(vd->z_src);
+    kvfree(vd->z_dst);
+    kvfree(vd->z_wrkmem);
+}
+
+/* --- Memory mapping -------------------------------------------------
+ *
+ * Store pages are mapped straight into user space, and holes read as
+ * the zero page until something fills them. Shared writable
+ * mappings are counted per region; the mirror catches up with them
+ * from the mirror worker on unmap and in vblock_mirror_sync() before
+ * it is read.
+ */
+
+static void vma_regions(struct vblock_dev *vd, struct vm_area_struct *vma,
+                        int *first, int *last)
+{
+    loff_t start = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
+    loff_t end = min_t(loff_t, start + (vma->vm_end - vma->vm_start),
+                       vd->size);
+
+    *first = start / vd->region_size;
+    *last = (end - 1) / vd->region_size;
+}
+
+static void vblock_vm_open(struct vm_area_struct *vma)
+{
+    struct vblock_dev *vd = file_vd(vma->vm_file);
+    int first, last, i;
+
+    atomic_inc(&vd->nr_maps);
+    if (!vma->vm_private_data)
+        return;
+
+    vma_regions(vd, vma, &first, &last);
+    spin_lock(&vd->map_lock);
+    for (i = first; i <= last; ++i)
+        vd->region_wmaps[i]++;
+    spin_unlock(&vd->map_lock);
+}
+
+static void vblock_vm_close(struct vm_area_struct *vma)
+{
+    struct vblock_dev *vd = file_vd(vma->vm_file);
+    int first, last, i;
+
+    atomic_dec(&vd->nr_maps);
+    if (!vma->vm_private_data)
+        return;
+
+    vma_regions(vd, vma, &first, &last);
+    spin_lock(&vd->map_lock);
+    for (i = first; i <= last; ++i) {
+        vd->region_wmaps[i]--;
+        clear_bit(i, vd->region_csum_valid);
+    }
+    vd->wmap_epoch++;
+    spin_unlock(&vd->map_lock);
+
+    /* Can't take region mutexes under mmap_lock; sync from the worker */
+    if (mirror_enable)
+        for (i = first; i <= last; ++i)
+            mirror_mark(vd, i);
+}
+
+/* Splitting would break the per-region accounting above */
+static int vblock_vm_may_split(struct vm_area_struct *vma, unsigned long addr)
+{
+    return -EINVAL;
+}
+
+/*
+ * A read fault on a hole maps the zero page rather than filling it, so
+ * scanning a sparse device through a mapping costs no memory. Whatever
+ * fills the hole later unmaps the zero page (see store_get_page()); the
+ * recheck after inserting it catches a fill that raced with us. Only
+ * the mapping recorded by vblock_mmap() can be unmapped that way, so
+ * holes reached through any other device node are filled as before.
+ */
+static vm_fault_t vblock_vm_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct vblock_dev *vd = file_vd(vma->vm_file);
+    struct address_space *mapping = vma->vm_file->f_mapping;
+    loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+    struct page *page;
+    vm_fault_t ret;
+
+    if (pos >= vd->size)
+        return VM_FAULT_SIGBUS;
+
+    if (!(vmf->flags & FAULT_FLAG_WRITE) &&
+        mapping == READ_ONCE(vd->data.mapping)) {
+        page = store_lookup(&vd->data, vmf->pgoff);
+        if (page) {
+            vmf->page = page;       /* store_lookup() took a reference */
+            return 0;
+        }
+
+        ret = vmf_insert_mixed(vma, vmf->address,
+                               pfn_to_pfn_t(my_zero_pfn(vmf->address)));
+        smp_mb();
+        if (xa_load(&vd->data.pages, vmf->pgoff))
+            unmap_mapping_range(mapping, pos, PAGE_SIZE, 0);
+        return ret;
+    }
+
+    page = store_get_page(&vd->data, vmf->pgoff, GFP_KERNEL);
+    if (!page)
+        return VM_FAULT_OOM;
+
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+/* A write through the zero page of a shared mapping: fill the hole,
+ * which unmaps the zero page, and let the write fault in the real page
+ */
+static vm_fault_t vblock_vm_pfn_mkwrite(struct vm_fault *vmf)
+{
+    struct vblock_dev *vd = file_vd(vmf->vma->vm_file);
+
+    if (!store_get_page(&vd->data, vmf->pgoff, GFP_KERNEL))
+        return VM_FAULT_OOM;
+    return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct vblock_vm_ops = {
+    .open        = vblock_vm_open,
+    .close       = vblock_vm_close,
+    .may_split   = vblock_vm_may_split,
+    .fault       = vblock_vm_fault,
+    .pfn_mkwrite = vblock_vm_pfn_mkwrite,
+};
+
+/*
+ * Private and read-only mappings are always allowed. A shared mapping
+ * that may become writable is refused if it covers a locked region;
+ * read-only shared mappings of locked regions lose VM_MAYWRITE so
+ * mprotect() cannot upgrade them later.
+ */
+static int vblock_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct vblock_dev *vd = file_vd(filp);
+    loff_t start = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    bool shared = vma->vm_flags & VM_SHARED;
+    bool any_locked = false;
+    int first, last, i;
+    int ret;
+
+    if (start >= vd->size || start + len > PAGE_ALIGN(vd->size))
+        return -EINVAL;
+
+    /* Freezing a region frees its pages; a mapping would pin stale ones */
+    if (vblock_compress)
+        return -EOPNOTSUPP;
+
+    vma_regions(vd, vma, &first, &last);
+
+    for (i = first; i <= last; ++i)
+        any_locked |= region_is_locked(vd, i);
+
+    if (shared && any_locked) {
+        if (vma->vm_flags & VM_WRITE)
+            return -EACCES;
+        vm_flags_clear(vma, VM_MAYWRITE);
+    }
+
+    /* Counted before looking for erased regions; pairs with
+     * region_fence_maps(). Their pages are about to be freed and can't
+     * be mapped until the reaper is done.
+     */
+    atomic_inc(&vd->nr_maps);
+    smp_mb__after_atomic();
+    for (i = first; i <= last; ++i) {
+        if (test_bit(i, vd->region_erased)) {
+            queue_work(system_unbound_wq, &vd->reap_work);
+            ret = -EAGAIN;
+            goto err_maps;
+        }
+    }
+
+    if (shared && (vma->vm_flags & VM_MAYWRITE)) {
+        spin_lock(&vd->map_lock);
+        for (i = first; i <= last; ++i) {
+            if (region_is_locked(vd, i)) {
+                /* Lost a race with VBLOCK_LOCK_REGION */
+                spin_unlock(&vd->map_lock);
+                ret = -EACCES;
+                goto err_maps;
+            }
+        }
+        for (i = first; i <= last; ++i)
+            vd->region_wmaps[i]++;
+        spin_unlock(&vd->map_lock);
+
+        /* Stores through the mapping never reach region_cow(); preserve
+         * now. Counted first, so a snapshot taken meanwhile sees the
+         * mapping and preserves the region itself.
+         */
+        for (i = first; i <= last; ++i) {
+            ret = region_cow(vd, i, GFP_KERNEL);
+
+            if (ret) {
+                spin_lock(&vd->map_lock);
+                for (i = first; i <= last; ++i)
+                    vd->region_wmaps[i]--;
+                spin_unlock(&vd->map_lock);
+                goto err_maps;
+            }
+        }
+        vma->vm_private_data = (void *)1UL;   /* counted as writable */
+    }
+
+    /* Record the first mapping (and pin its inode) so filled holes can
+     * be unmapped from it; see vblock_vm_fault()
+     */
+    if (!READ_ONCE(vd->data.mapping)) {
+        struct inode *inode = igrab(file_inode(filp));
+
+        if (inode && cmpxchg(&vd->data.mapping, NULL, inode->i_mapping))
+            iput(inode);
+    }
+
+    /* Mixed: store pages, and the zero page for holes */
+    vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &vblock_vm_ops;
+    return 0;
+
+err_maps:
+    atomic_dec(&vd->nr_maps);
+    return ret;
+}
+
+/* --- Snapshots ------------------------------------------------------
+ *
+ * Taking a snapshot copies no data: with writers frozen out it clears
+ * the preserved bits and sets snap_active. Regions are then copied
+ * lazily by region_cow(), except those with a live writable mapping,
+ * whose stores cannot be caught and which are therefore copied at once.
+ * One snapshot exists at a time.
+ *
+ * Writers are frozen by taking snap_freeze exclusive, one device-level
+ * lock rather than every region mutex: create waits for an RCU grace
+ * period and for the writer sections already in flight, and new writers
+ * block only for that long (plus the copies of mapped regions). Clearing
+ * the bitmap is still linear, but in words, not locks.
+ */
+
+static int vblock_snapshot_create(struct vblock_dev *vd, u64 *id)
+{
+    int ret = 0;
+    int i;
+
+    down_write(&vd->snap_rwsem);
+    if (vd->snap_active) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    percpu_down_write(&vd->snap_freeze);
+
+    mutex_lock(&vd->snap_mutex);
+    bitmap_zero(vd->snap_preserved, vd->num_regions);
+    WRITE_ONCE(vd->snap_active, true);
+    mutex_unlock(&vd->snap_mutex);
+
+    /* No writer section is open; the mutex keeps out the paths that
+     * change a region's pages outside one
+     */
+    for (i = 0; i < vd->num_regions && !ret; ++i) {
+        if (!region_mmap_dirty(vd, i))
+            continue;
+        region_lock(vd, i);
+        ret = region_cow(vd, i, GFP_KERNEL);
+        mutex_unlock(&vd->region_mutex[i]);
+    }
+
+    if (ret) {
+        mutex_lock(&vd->snap_mutex);
+        WRITE_ONCE(vd->snap_active, false);
+        bitmap_zero(vd->snap_preserved, vd->num_regions);
+        store_free(&vd->snap);
+        mutex_unlock(&vd->snap_mutex);
+    } else {
+        *id = ++vd->snap_id;
+    }
+
+    percpu_up_write(&vd->snap_freeze);
+out:
+    up_write(&vd->snap_rwsem);
+    return ret;
+}
+
+static int vblock_snapshot_drop(struct vblock_dev *vd)
+{
+    int ret = 0;
+
+    down_write(&vd->snap_rwsem);
+    if (!vd->snap_active) {
+        ret = -ENOENT;
+    } else {
+        /* region_cow() rechecks snap_active under this mutex */
+        mutex_lock(&vd->snap_mutex);
+        WRITE_ONCE(vd->snap_active, false);
+        bitmap_zero(vd->snap_preserved, vd->num_regions);
+        store_free(&vd->snap);
+        mutex_unlock(&vd->snap_mutex);
+    }
+    up_write(&vd->snap_rwsem);
+    return ret;
+}
+
+/* --- File operations ----------------------------------------------- */
+
+static int vblock_open(struct inode *inode, struct file *filp)
+{
+    struct vblock_file *vf;
+
+    vf = kzalloc(sizeof(*vf), GFP_KERNEL);
+    if (!vf)
+        return -ENOMEM;
+
+    vf->vd = container_of(inode->i_cdev, struct vblock_dev, cdev);
+    spin_lock_init(&vf->auth_lock);
+    mutex_init(&vf->watch_mutex);
+    filp->private_data = vf;
+    /* read_iter/write_iter honour IOCB_NOWAIT */
+    filp->f_mode |= FMODE_NOWAIT;
+    return 0;
+}
+
+static int vblock_release(struct inode *inode, struct file *filp)
+{
+    struct vblock_file *vf = filp->private_data;
+
+    vblock_jobs_release(vf);
+    watch_clear(vf->vd, vf);
+    bitmap_free(vf->watch);
+    bitmap_free(vf->caps);
+    kfree(vf);
+    return 0;
+}
+
+/* llseek to support arbitrary offsets */
+static loff_t vblock_llseek(struct file *file, loff_t off, int whence)
+{
+    struct vblock_dev *vd = file_vd(file);
+    loff_t newpos = 0;
+
+    switch (whence) {
+    case SEEK_SET:
+        newpos = off;
+        break;
+    case SEEK_CUR:
+        newpos = file->f_pos + off;
+        break;
+    case SEEK_END:
+        newpos = vd->size + off;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (newpos < 0 || newpos > vd->size)
+        return -EINVAL;
+
+    file->f_pos = newpos;
+    return newpos;
+}
+
+/* Arbitrary read: always allowed, ignores lock state.
+ * Reads are lockless and consistent per region: a chunk that overlaps a
+ * concurrent write to its region is copied again. A vectored read
+ * scatters across any number of regions in one call. A read that stops
+ * part-way returns the bytes copied so far.
+ */
+static ssize_t vblock_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct vblock_dev *vd = file_vd(iocb->ki_filp);
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t remaining;
+    int region;
+    int ret;
+
+    if (pos >= vd->size)
+        return 0;
+
+    remaining = min_t(u64, count, vd->size - pos);
+    if (remaining == 0)
+        return 0;
+
+    region = pos / vd->region_size;
+    if (region == (pos + remaining - 1) / vd->region_size)
+        ret = region_read_iter(vd, &vd->data, region, pos, remaining, to,
+                               nowait, NULL);
+    else
+        ret = span_read_iter(vd, pos, remaining, to, nowait);
+
+    /* What was copied before a fault or -EAGAIN is still returned */
+    remaining = count - iov_iter_count(to);
+    if (ret && !remaining)
+        return ret;
+
+    iocb->ki_pos = pos + remaining;
+    return remaining;
+}
+
+/* May a writer holding @key (if @has_key), or else @vf's session (if
+ * any), change @region?
+ */
+static bool region_may_write(struct vblock_dev *vd, int region,
+                             struct vblock_file *vf, bool has_key, int key)
+{
+    u64 t0;
+    bool ok;
+
+    if (!has_key && session_may_write(vd, vf, region))
+        return true;
+
+    if (!region_is_locked(vd, region))
+        return true;
+
+    t0 = trace_vblock_key_check_enabled() ? local_clock() : 0;
+    ok = has_key && key_is_authorized(vd, key, region);
+    trace_vblock_key_check(vd->id, region, has_key, key, ok, t0);
+
+    if (!ok)
+        region_stat_add(vd, region,
+                        has_key ? RSTAT_KEY_FAILS : RSTAT_LOCK_FAILS, 1);
+    return ok;
+}
+
+/*
+ * Write [pos, pos + len) from @from as one unit. Every region involved
+ * is locked (ascending) and checked against @key, or without one
+ * against @vf's session, before any byte changes, so either nothing is
+ * written or readers see the whole write. Every page the write (and a
+ * synchronous mirror) needs is allocated during the checks, and a
+ * multi-region write from user memory is first copied into a bounce
+ * buffer, so neither -ENOMEM nor a bad buffer can tear it. A
+ * single-region write copies straight from user memory; a fault there
+ * leaves part of that one region written, as a short write would.
+ * A multi-region write can't honour GFP_NOWAIT (the span mutex and the
+ * region mutexes would all need trylocks) and returns -EAGAIN for the
+ * caller to retry blocking. One longer than VBLOCK_SPAN_MAX is refused.
+ */
+static int vblock_write_span(struct vblock_dev *vd, loff_t pos, size_t len,
+                             struct iov_iter *from, struct vblock_file *vf,
+                             bool has_key, int key, gfp_t gfp)
+{
+    int first = pos / vd->region_size;
+    int last = (pos + len - 1) / vd->region_size;
+    u64 t0 = local_clock();
+    void *bounce = NULL;
+    struct iov_iter iter;
+    struct kvec kv;
+    int region;
+    int ret = 0;
+
+    if (first != last && len > VBLOCK_SPAN_MAX)
+        return -EINVAL;
+
+    if (gfp == GFP_NOWAIT) {
+        if (first != last || !region_write_trylock(vd, first))
+            return -EAGAIN;
+    } else {
+        if (first != last && !iov_iter_is_kvec(from)) {
+            bounce = kvmalloc(len, GFP_KERNEL);
+            if (!bounce)
+                return -ENOMEM;
+            if (copy_from_iter(bounce, len, from) != len) {
+                kvfree(bounce);
+                return -EFAULT;
+            }
+            kv.iov_base = bounce;
+            kv.iov_len = len;
+            iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+            from = &iter;
+        }
+        span_write_begin(vd, first, last);
+    }
+
+    for (region = first; region <= last && !ret; ++region) {
+        loff_t start = max_t(loff_t, pos, region_start(vd, region));
+        loff_t end = min_t(loff_t, pos + len,
+                           region_start(vd, region) + vd->region_size);
+
+        if (!region_may_write(vd, region, vf, has_key, key))
+            ret = -EACCES;
+        else
+            ret = __region_thaw(vd, region, gfp);
+
+        if (!ret)
+            ret = region_cow(vd, region, gfp);
+        if (!ret)
+            ret = store_reserve(&vd->data, start, end - start, gfp);
+        if (!ret && mirror_enable && !READ_ONCE(mirror_async))
+            ret = store_reserve(&vd->mirror, start, end - start, gfp);
+    }
+
+    for (region = first; region <= last && !ret; ++region) {
+        loff_t start = max_t(loff_t, pos, region_start(vd, region));
+        loff_t end = min_t(loff_t, pos + len,
+                           region_start(vd, region) + vd->region_size);
+        size_t left = iov_iter_count(from);
+        size_t n;
+        int err;
+
+        /* Short only on a fault, so only for a single region */
+        ret = store_write_iter(&vd->data, start, end - start, from, gfp);
+        n = left - iov_iter_count(from);
+        region_changed(vd, region);
+
+        if (n) {
+            err = region_mirror(vd, region, start, n, gfp);
+            if (!ret)
+                ret = err;
+        }
+        if (!ret)
+            region_stat_io(vd, region, true, end - start);
+    }
+
+    span_write_end(vd, first, last);
+    kvfree(bounce);
+    if (!ret)
+        lat_record(vd, VBLOCK_LAT_WRITE, t0);
+    trace_vblock_write(vd->id, first, last, pos, len, ret, t0);
+    return ret;
+}
+
+/*
+ * Binary mode write: raw bytes land at ki_pos, no parsing and no
+ * per-call allocation. Locked regions are checked against the session
+ * started by VBLOCK_SET_MODE or VBLOCK_AUTH. Writes may span regions
+ * and are atomic across them (see vblock_write_span()), up to
+ * VBLOCK_SPAN_MAX bytes: a longer spanning write stops there and
+ * returns a short count, as write(2) may, and so does a single-region
+ * write that faults part-way. With IOCB_NOWAIT a contended
+ * region, a page that can't be allocated without sleeping or a
+ * spanning write fails with -EAGAIN.
+ */
+static ssize_t vblock_write_binary(struct vblock_file *vf,
+                                   struct kiocb *iocb, struct iov_iter *from)
+{
+    struct vblock_dev *vd = vf->vd;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    bool span;
+    size_t len;
+    int ret;
+
+    if (pos >= vd->size)
+        return -ENOSPC;
+
+    len = min_t(u64, count, vd->size - pos);
+    span = pos / vd->region_size != (pos + len - 1) / vd->region_size;
+    if (span)
+        len = min_t(size_t, len, VBLOCK_SPAN_MAX);
+
+    ret = vblock_write_span(vd, pos, len, from, vf, false, 0,
+                            nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (ret) {
+        /* A spanning write is all or nothing, even though its bounce
+         * buffer consumed @from; a single region keeps what landed
+         * before a fault
+         */
+        if (span || count == iov_iter_count(from))
+            return ret;
+        len = count - iov_iter_count(from);
+    }
+
+    iocb->ki_pos = pos + len;
+    return len;
+}
+
+/*
+ * Write format when region may be locked:
+ *   "<key>:<offset>:<data>"
+ *
+ * If region locked:
+ *   - key must be present and valid for the region in the key store
+ * If region unlocked, or opened by the session VBLOCK_AUTH started on
+ * this file:
+ *   - key may be omitted by using:
+ *       "<offset>:<data>"
+ *   which skips the key parsing and lookup.
+ *
+ * offset is a global byte offset (0..size-1).
+ * data may cross region boundaries; the key must then be valid for
+ * every locked region it touches, and the write is atomic across them.
+ * All segments of a vectored write form one message. The parser path
+ * has no IOCB_NOWAIT support; io_uring retries it from a worker.
+ */
+static ssize_t vblock_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct vblock_file *vf = iocb->ki_filp->private_data;
+    struct vblock_dev *vd = vf->vd;
+    size_t count = iov_iter_count(from);
+    char *kbuf, *p;
+    char *first, *second;
+    char *data_str;
+    int key = -1;
+    bool key_present = false;
+    unsigned long long offset;
+    size_t data_len;
+    struct kvec kv;
+    struct iov_iter iter;
+    int ret;
+
+    if (count == 0)
+        return 0;
+
+    if (vf->binary)
+        return vblock_write_binary(vf, iocb, from);
+
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return -EAGAIN;
+
+    if (count > 1023) /* arbitrary sanity limit */
+        return -EINVAL;
+
+    kbuf = kzalloc(count + 1, GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
+
+    if (copy_from_iter(kbuf, count, from) != count) {
+        kfree(kbuf);
+        return -EFAULT;
+    }
+    kbuf[count] = '\0';
+
+    p = kbuf;
+
+    /* Split on ':' */
+    first = strsep(&p, ":");
+    if (!first) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    second = strsep(&p, ":");
+    if (!second) {
+        /* Need at least two fields */
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (p) {
+        /* Form: key:offset:data */
+        data_str = p;
+        key_present = true;
+        if (kstrtoint(first, 10, &key)) {
+            ret = -EINVAL;
+            goto out;
+        }
+        if (kstrtoull(second, 10, &offset)) {
+            ret = -EINVAL;
+            goto out;
+        }
+    } else {
+        /* Form: offset:data (no key) */
+        data_str = second;
+        key_present = false;
+        if (kstrtoull(first, 10, &offset)) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    data_len = strlen(data_str);
+
+    if (offset >= vd->size) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (data_len == 0) {
+        ret = 0;
+        goto out;
+    }
+    if (offset + data_len > vd->size) {
+        /* prevent overrun */
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Lock + key checks happen under the region locks */
+    kv.iov_base = data_str;
+    kv.iov_len = data_len;
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, data_len);
+
+    ret = vblock_write_span(vd, offset, data_len, &iter, vf, key_present,
+                            key, GFP_KERNEL);
+    if (ret)
+        goto out;
+
+    /* We report full count consumed (what user wrote) */
+    iocb->ki_pos = offset + data_len;
+    ret = count;
+
+out:
+    kfree(kbuf);
+    return ret;
+}
+
+/*
+ * VBLOCK_READ_BATCH: copy every region set in the user bitmap into
+ * consecutive region_size slots of one buffer. With
+ * VBLOCK_BATCH_SKIP_SAME, a region whose generation still equals the
+ * caller's gens[] entry is not copied and its mask bit is cleared.
+ * Regions with a writable mapping have no reliable generation and are
+ * always copied.
+ */
+static long vblock_ioctl_read_batch(struct vblock_dev *vd, void __user *argp)
+{
+    struct vblock_batch_read br;
+    unsigned long *mask;
+    u64 *words;
+    u64 __user *ugens;
+    char __user *ubuf;
+    unsigned int nwords, nreq, slot = 0;
+    int region, ret = 0;
+
+    if (copy_from_user(&br, argp, sizeof(br)))
+        return -EFAULT;
+
+    if (br.flags & ~(VBLOCK_BATCH_GENS | VBLOCK_BATCH_SKIP_SAME))
+        return -EINVAL;
+    if (!br.mask_bits || br.mask_bits > vd->num_regions)
+        return -EINVAL;
+    if ((br.flags & VBLOCK_BATCH_SKIP_SAME) && !br.gens)
+        return -EINVAL;
+
+    nwords = DIV_ROUND_UP(br.mask_bits, 64);
+    words = kcalloc(nwords, sizeof(u64), GFP_KERNEL);
+    mask = bitmap_zalloc(br.mask_bits, GFP_KERNEL);
+    if (!words || !mask) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (copy_from_user(words, u64_to_user_ptr(br.mask),
+                       nwords * sizeof(u64))) {
+        ret = -EFAULT;
+        goto out;
+    }
+    bitmap_from_arr64(mask, words, br.mask_bits);
+
+    nreq = bitmap_weight(mask, br.mask_bits);
+    if (br.buf_len < (u64)nreq * vd->region_size) {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    ubuf = u64_to_user_ptr(br.buf);
+    ugens = u64_to_user_ptr(br.gens);
+    br.nr_copied = 0;
+    br.nr_skipped = 0;
+
+    for_each_set_bit(region, mask, br.mask_bits) {
+        struct iov_iter iter;
+        u64 gen;
+
+        if ((br.flags & VBLOCK_BATCH_SKIP_SAME) &&
+            !region_mmap_dirty(vd, region)) {
+            u64 seen;
+
+            if (get_user(seen, ugens + slot)) {
+                ret = -EFAULT;
+                goto out;
+            }
+            if (seen == READ_ONCE(vd->region_gen[region])) {
+                __clear_bit(region, mask);
+                br.nr_skipped++;
+                slot++;
+                continue;
+            }
+        }
+
+        ret = import_ubuf(ITER_DEST,
+                          ubuf + (size_t)slot * vd->region_size,
+                          vd->region_size, &iter);
+        if (!ret)
+            ret = region_read_iter(vd, &vd->data, region,
+                                   region_start(vd, region), vd->region_size,
+                                   &iter, false, &gen);
+        if (ret)
+            goto out;
+
+        if ((br.flags & (VBLOCK_BATCH_GENS | VBLOCK_BATCH_SKIP_SAME)) &&
+            put_user(gen, ugens + slot)) {
+            ret = -EFAULT;
+            goto out;
+        }
+
+        br.nr_copied++;
+        slot++;
+    }
+
+    /* Hand back the set of regions actually copied */
+    bitmap_to_arr64(words, mask, br.mask_bits);
+    if (copy_to_user(u64_to_user_ptr(br.mask), words, nwords * sizeof(u64)) ||
+        copy_to_user(argp, &br, sizeof(br)))
+        ret = -EFAULT;
+
+out:
+    bitmap_free(mask);
+    kfree(words);
+    return ret;
+}
+
+/*
+ * VBLOCK_GET_LOCK_BITMAP: copy the lock bits of up to
+ * VBLOCK_LOCKMAP_MAX_BITS regions from .first, which must be a
+ * multiple of 64 so every word maps onto whole bitmap words. The
+ * snapshot is taken without locks, so each bit is only as current as
+ * the moment it was read.
+ */
+static long vblock_ioctl_lock_bitmap(struct vblock_dev *vd, void __user *argp)
+{
+    struct vblock_lock_bitmap lb;
+    unsigned int nwords;
+    u64 *words;
+    long ret = 0;
+
+    if (copy_from_user(&lb, argp, sizeof(lb)))
+        return -EFAULT;
+
+    if (lb.first % 64 || lb.first >= vd->num_regions)
+        return -EINVAL;
+
+    lb.nr = min3(lb.nr, vd->num_regions - lb.first,
+                 (u32)VBLOCK_LOCKMAP_MAX_BITS);
+    if (!lb.nr)
+        return -EINVAL;
+
+    nwords = DIV_ROUND_UP(lb.nr, 64);
+    words = kcalloc(nwords, sizeof(u64), GFP_KERNEL);
+    if (!words)
+        return -ENOMEM;
+
+    bitmap_to_arr64(words, vd->region_lock_bitmap + lb.first / BITS_PER_LONG,
+                    lb.nr);
+
+    if (copy_to_user(u64_to_user_ptr(lb.bits), words, nwords * sizeof(u64)) ||
+        copy_to_user(argp, &lb, sizeof(lb)))
+        ret = -EFAULT;
+
+    kfree(words);
+    return ret;
+}
+
+/* --- IOCTL Handler ------------------------------------------------- */
+
+static long __vblock_ioctl(struct file *filp,
+                           unsigned int cmd, unsigned long arg)
+{
+    struct vblock_dev *vd = file_vd(filp);
+    int region;
+    int __user *argp_int = (int __user *)arg;
+
+    switch (cmd) {
+
+    case VBLOCK_LOCK_REGION:
+        if (get_user(region, argp_int))
+            return -EFAULT;
+        if (region < 0 || region >= vd->num_regions)
+            return -EINVAL;
+
+        region_lock(vd, region);
+        spin_lock(&vd->map_lock);
+        if (vd->region_wmaps[region]) {
+            /* A shared writable mapping would bypass the key check */
+            spin_unlock(&vd->map_lock);
+            mutex_unlock(&vd->region_mutex[region]);
+            region_stat_add(vd, region, RSTAT_LOCK_FAILS, 1);
+            return -EBUSY;
+        }
+        lock_region_bit(vd, region);
+        spin_unlock(&vd->map_lock);
+        mutex_unlock(&vd->region_mutex[region]);
+        return 0;
+
+    case VBLOCK_UNLOCK_REGION:
+        if (get_user(region, argp_int))
+            return -EFAULT;
+        if (region < 0 || region >= vd->num_regions)
+            return -EINVAL;
+
+        region_lock(vd, region);
+        unlock_region_bit(vd, region);
+        mutex_unlock(&vd->region_mutex[region]);
+        return 0;
+
+    case VBLOCK_READ_REGION: {
+        struct vblock_region kregion;
+        int ret;
+
+        if (copy_from_user(&kregion, (void __user *)arg, sizeof(kregion)))
+            return -EFAULT;
+
+        /* Fixed-size struct only fits the default geometry */
+        if (vd->region_size != VBLOCK_REGION_SIZE)
+            return -EINVAL;
+
+        if (kregion.region_index >= vd->num_regions)
+            return -EINVAL;
+
+        if (READ_ONCE(vblock_csum) > 1) {
+            ret = region_verify(vd, kregion.region_index);
+            if (ret)
+                return ret;
+        }
+
+        ret = region_read_kernel(vd, &vd->data, kregion.region_index,
+                                 region_start(vd, kregion.region_index),
+                                 kregion.data, VBLOCK_REGION_SIZE);
+
+        if (ret)
+            return ret;
+
+        if (copy_to_user((void __user *)arg, &kregion, sizeof(kregion)))
+            return -EFAULT;
+
+        return 0;
+    }
+
+    case VBLOCK_READ_REGION_BUF: {
+        struct vblock_region_buf rb;
+        struct vblock_store *s;
+        struct iov_iter iter;
+        int ret;
+
+        if (copy_from_user(&rb, (void __user *)arg, sizeof(rb)))
+            return -EFAULT;
+
+        if (rb.region_index >= vd->num_regions ||
+            rb.offset > vd->region_size ||
+            (rb.flags & ~(VBLOCK_RB_MIRROR | VBLOCK_RB_SNAPSHOT)) ||
+            (rb.flags & VBLOCK_RB_MIRROR && rb.flags & VBLOCK_RB_SNAPSHOT))
+            return -EINVAL;
+
+        if (rb.flags & VBLOCK_RB_SNAPSHOT)
+            s = NULL;
+        else if (rb.flags & VBLOCK_RB_MIRROR)
+            s = &vd->mirror;
+        else
+            s = &vd->data;
+        rb.len = min_t(u64, rb.len, vd->region_size - rb.offset);
+
+        if (s == &vd->mirror)
+            vblock_mirror_sync(vd, rb.region_index);
+
+        if (s == &vd->data && READ_ONCE(vblock_csum) > 1) {
+            ret = region_verify(vd, rb.region_index);
+            if (ret)
+                return ret;
+        }
+
+        ret = import_ubuf(ITER_DEST, u64_to_user_ptr(rb.data), rb.len, &iter);
+        if (ret)
+            return ret;
+
+        if (!s) {
+            down_read(&vd->snap_rwsem);
+            if (!vd->snap_active) {
+                up_read(&vd->snap_rwsem);
+                return -ENOENT;
+            }
+        }
+
+        ret = region_read_iter(vd, s, rb.region_index,
+                               region_start(vd, rb.region_index) + rb.offset,
+                               rb.len, &iter, false, NULL);
+
+        if (!s)
+            up_read(&vd->snap_rwsem);
+
+        if (ret)
+            return ret;
+
+        if (copy_to_user((void __user *)arg, &rb, sizeof(rb)))
+            return -EFAULT;
+
+        return 0;
+    }
+
+    case VBLOCK_GET_INFO: {
+        struct vblock_info info;
+
+        memset(&info, 0, sizeof(info));
+        info.size           = vd->size;
+        info.region_size    = vd->region_size;
+        info.num_regions    = vd->num_regions;
+        info.resident_pages = atomic_long_read(&vd->data.nr_pages);
+        info.mirror_pages   = atomic_long_read(&vd->mirror.nr_pages);
+        info.page_size      = PAGE_SIZE;
+        info.lock_bitmap    = vd->region_lock_bitmap[0] & 0xff;
+
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+
+        return 0;
+    }
+
+    case VBLOCK_GET_INFO_V1: {
+        struct vblock_info_v1 info;
+
+        if (vd->size > U32_MAX)
+            return -EOVERFLOW;
+
+        memset(&info, 0, sizeof(info));
+        info.size           = vd->size;
+        info.region_size    = vd->region_size;
+        info.num_regions    = vd->num_regions;
+        info.lock_bitmap    = vd->region_lock_bitmap[0] & 0xff;
+
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+
+        return 0;
+    }
+
+case VBLOCK_READ_MIRROR: {
+    struct vblock_region r;
+    int ret;
+
+    if (copy_from_user(&r, (void __user *)arg, sizeof(r)))
+        return -EFAULT;
+
+    if (vd->region_size != VBLOCK_REGION_SIZE)
+        return -EINVAL;
+
+    if (r.region_index < 0 || r.region_index >= vd->num_regions)
+        return -EINVAL;
+
+    vblock_mirror_sync(vd, r.region_index);
+
+    ret = region_read_kernel(vd, &vd->mirror, r.region_index,
+                             region_start(vd, r.region_index),
+                             r.data, VBLOCK_REGION_SIZE);
+    if (ret)
+        return ret;
+
+    if (copy_to_user((void __user *)arg, &r, sizeof(r)))
+        return -EFAULT;
+
+    return 0;
+}
+
+case VBLOCK_BACKUP: {
+    char path[256];
+
+    if (copy_from_user(path, (char __user *)arg, sizeof(path)))
+        return -EFAULT;
+
+    path[255] = '\0';
+
+    return vblock_backup_path(vd, path, 0);
+}
+
+    case VBLOCK_BACKUP_ASYNC:
+        return vblock_backup_async(filp->private_data, (void __user *)arg);
+
+    case VBLOCK_BACKUP_EX: {
+        struct vblock_backup_req req;
+
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+
+        if (!backup_flags_valid(req.flags))
+            return -EINVAL;
+        req.path[sizeof(req.path) - 1] = '\0';
+
+        return vblock_backup_path(vd, req.path, req.flags);
+    }
+
+    case VBLOCK_SNAPSHOT_CREATE: {
+        u64 id;
+        int ret;
+
+        ret = vblock_snapshot_create(vd, &id);
+        if (ret)
+            return ret;
+
+        if (put_user(id, (__u64 __user *)arg))
+            return -EFAULT;
+
+        return 0;
+    }
+
+    case VBLOCK_SNAPSHOT_DROP:
+        return vblock_snapshot_drop(vd);
+
+    case VBLOCK_MIRROR_STAT: {
+        struct vblock_mirror_stat st;
+
+        vblock_mirror_get_stat(vd, &st);
+        if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+            return -EFAULT;
+
+        return 0;
+    }
+
+    case VBLOCK_MIRROR_FLUSH:
+        if (!mirror_enable)
+            return -EOPNOTSUPP;
+
+        vblock_mirror_flush(vd);
+        return 0;
+
+    case VBLOCK_KEY_ADD:
+        return vblock_ioctl_key_add(vd, (void __user *)arg);
+
+    case VBLOCK_KEY_REVOKE: {
+        int key;
+
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (get_user(key, argp_int))
+            return -EFAULT;
+
+        return vblock_key_revoke(vd, key);
+    }
+
+    case VBLOCK_GET_STATS:
+        return vblock_ioctl_get_stats(vd, (void __user *)arg);
+
+    case VBLOCK_RESTORE: {
+        struct vblock_restore_req req;
+        int ret;
+
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        if (req.flags & ~(VBLOCK_RESTORE_F_LOCKS | VBLOCK_RESTORE_F_RAW))
+            return -EINVAL;
+
+        req.path[sizeof(req.path) - 1] = '\0';
+        ret = vblock_restore_path(vd, req.path, req.flags, &req.restored);
+
+        if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+            return -EFAULT;
+        return ret;
+    }
+
+    case VBLOCK_COMPRESS_STAT: {
+        struct vblock_compress_stat st;
+
+        vblock_compress_get_stat(vd, &st);
+        if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+            return -EFAULT;
+
+        return 0;
+    }
+
+    case VBLOCK_GET_LOCK_BITMAP:
+        return vblock_ioctl_lock_bitmap(vd, (void __user *)arg);
+
+    case VBLOCK_GET_REGION_INFO: {
+        struct vblock_region_info ri;
+        struct vblock_region_meta *m;
+
+        if (copy_from_user(&ri, (void __user *)arg, sizeof(ri)))
+            return -EFAULT;
+        if (ri.region_index >= vd->num_regions)
+            return -EINVAL;
+
+        region = ri.region_index;
+        m = &vd->region_meta[region];
+
+        memset(&ri, 0, sizeof(ri));
+        ri.region_index = region;
+
+        mutex_lock(&vd->region_mutex[region]);
+        ri.locked       = region_is_locked(vd, region);
+        ri.owner_pid    = m->owner_pid;
+        ri.owner_uid    = m->owner_uid;
+        ri.lock_time_ns = m->lock_time;
+        ri.lock_gen     = m->lock_gen;
+        ri.gen          = vd->region_gen[region];
+        mutex_unlock(&vd->region_mutex[region]);
+
+        if (copy_to_user((void __user *)arg, &ri, sizeof(ri)))
+            return -EFAULT;
+
+        return 0;
+    }
+
+    case VBLOCK_BACKUP_STATUS:
+        return vblock_backup_status(filp->private_data, (void __user *)arg);
+
+    case VBLOCK_ERASE_REGION: {
+        int ret;
+
+        if (get_user(region, argp_int))
+            return -EFAULT;
+        if (region < 0 || region >= vd->num_regions)
+            return -EINVAL;
+
+        region_write_begin(vd, region);
+        ret = region_erase(vd, region);
+        region_write_end(vd, region);
+
+        return ret;
+    }
+
+    case VBLOCK_DISCARD: {
+        struct vblock_file *vf = filp->private_data;
+        struct vblock_discard d;
+
+        if (copy_from_user(&d, (void __user *)arg, sizeof(d)))
+            return -EFAULT;
+
+        if (d.flags || d.len > vd->size || d.offset > vd->size - d.len)
+            return -EINVAL;
+
+        return vblock_discard(vd, d.offset, d.len, vf);
+    }
+
+    case VBLOCK_READ_BATCH:
+        return vblock_ioctl_read_batch(vd, (void __user *)arg);
+
+    case VBLOCK_SET_MODE: {
+        struct vblock_file *vf = filp->private_data;
+        struct vblock_mode mode;
+
+        if (copy_from_user(&mode, (void __user *)arg, sizeof(mode)))
+            return -EFAULT;
+
+        if (mode.mode > VBLOCK_MODE_BINARY || (mode.flags & ~VBLOCK_MODE_F_KEY))
+            return -EINVAL;
+
+        if (mode.flags & VBLOCK_MODE_F_KEY) {
+            int ret = session_start(vd, vf, mode.key);
+
+            if (ret < 0)
+                return ret;
+        } else {
+            session_end(vf);
+        }
+
+        vf->binary = mode.mode == VBLOCK_MODE_BINARY;
+        return 0;
+    }
+
+    case VBLOCK_AUTH:
+        return vblock_ioctl_auth(vd, filp->private_data, (void __user *)arg);
+
+    case VBLOCK_WATCH:
+        return vblock_ioctl_watch(vd, filp->private_data,
+                                  (void __user *)arg);
+
+    case VBLOCK_WATCH_CHANGES:
+        return vblock_ioctl_watch_changes(vd, filp->private_data,
+                                          (void __user *)arg);
+
+    case VBLOCK_DEV_ADD:
+        return vblock_dev_add((void __user *)arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+static long vblock_ioctl(struct file *filp,
+                         unsigned int cmd, unsigned long arg)
+{
+    struct vblock_dev *vd = file_vd(filp);
+    u64 t0;
+    long ret;
+
+    if (!trace_vblock_ioctl_enabled())
+        return __vblock_ioctl(filp, cmd, arg);
+
+    t0 = local_clock();
+    ret = __vblock_ioctl(filp, cmd, arg);
+    trace_vblock_ioctl(vd->id, cmd, ret, t0);
+    return ret;
+}
+
+/* --- Exported backup API -------------------------------------------
+ *
+ * int vblock_backup_to_file(const char *path)
+ *   - path: kernel-space string with absolute path
+ *   - returns 0 on success or negative errno
+ *
+ * The image is streamed region by region through a bounce buffer, so
+ * backing up a large device does not need a device-sized allocation.
+ * Chunks with no resident pages are skipped and left as file holes.
+ *
+ * Backups take no global lock, so region reads and other backups run
+ * alongside them. Each region is copied under a seqcount read section
+ * spanning the whole region and redone if a writer overlapped it; after
+ * VBLOCK_SEQ_RETRIES attempts the region mutex is held for the copy.
+ * Every region in the image is therefore internally consistent.
+ *
+ * This is EXPORT_SYMBOL so other kernel modules can trigger backup.
+ * It backs up /dev/vblock0; VBLOCK_BACKUP backs up the device it is
+ * issued on.
+ */
+
+/* Copy one region to @fpos in the file, extending *@crc (if set) over
+ * what was copied. Returns -EAGAIN if a writer touched the region during
+ * an unlocked copy. Holes are only skipped on the first pass, since a
+ * redo must overwrite whatever the failed pass left; the final chunk of
+ * the file (@last) is always written so the file has its full size.
+ */
+static int backup_region(struct vblock_dev *vd, struct file *filp,
+                         struct vblock_store *s, int region, loff_t fpos,
+                         u8 *tmp, bool locked, bool sparse, bool last,
+                         atomic64_t *bytes, u32 *crc)
+{
+    loff_t pos = region_start(vd, region);
+    loff_t end = pos + vd->region_size;
+    unsigned int seq = 0;
+    ssize_t written;
+
+    if (!locked) {
+        seq = raw_read_seqcount(&vd->region_seq[region]);
+        if ((seq & 1) || region_needs_thaw(vd, region))
+            return -EAGAIN;
+    }
+    s = region_src(vd, s, region);
+
+    while (pos < end) {
+        size_t chunk = min_t(u64, VBLOCK_BACKUP_CHUNK, end - pos);
+
+        if (sparse && !(last && pos + chunk == end) &&
+            store_range_empty(s, pos, chunk)) {
+            if (crc)
+                *crc = csum_zeros(*crc, chunk);
+            pos += chunk;
+            fpos += chunk;
+            continue;
+        }
+
+        store_read_kernel(s, pos, tmp, chunk);
+        if (crc)
+            *crc = crc32c(*crc, tmp, chunk);
+
+        written = kernel_write(filp, tmp, chunk, &fpos);
+        if (written != chunk)
+            return written < 0 ? (int)written : -EIO;
+
+        pos += chunk;
+        if (bytes)
+            atomic64_add(written, bytes);
+    }
+
+    if (!locked && read_seqcount_retry(&vd->region_seq[region], seq))
+        return -EAGAIN;
+
+    return 0;
+}
+
+/* Copy one region of @s (NULL: the snapshot view), redoing it until no
+ * writer overlapped the copy. Copies of the data are checksummed, and
+ * redone if that repaired the region.
+ */
+static int backup_one(struct vblock_dev *vd, struct file *filp,
+                      struct vblock_store *s, int region, loff_t fpos, u8 *tmp,
+                      bool last, atomic64_t *bytes)
+{
+    u64 t0 = trace_vblock_backup_region_enabled() ? local_clock() : 0;
+    bool verify = s == &vd->data && READ_ONCE(vblock_csum);
+    int tries, ret;
+
+    for (tries = 0; ; ++tries) {
+        bool locked = tries >= VBLOCK_SEQ_RETRIES;
+        u32 crc = ~0U;
+        u64 stamp;
+
+        if (locked) {
+            region_lock(vd, region);
+            ret = __region_thaw(vd, region, GFP_KERNEL);
+        } else {
+            ret = region_thaw(vd, region, false);
+        }
+        stamp = region_csum_stamp(vd, region);
+        if (!ret)
+            ret = backup_region(vd, filp, s, region, fpos, tmp, locked,
+                                tries == 0, last, bytes,
+                                verify ? &crc : NULL);
+        if (!ret && verify) {
+            if (!locked)
+                region_lock(vd, region);
+            ret = __region_csum_check(vd, region, stamp, crc);
+            if (!locked)
+                mutex_unlock(&vd->region_mutex[region]);
+        }
+        if (locked)
+            mutex_unlock(&vd->region_mutex[region]);
+
+        if (ret != -EAGAIN)
+            break;
+    }
+
+    trace_vblock_backup_region(vd->id, region, fpos, tries + 1, ret, t0);
+    return ret;
+}
+
+/* Header and lock bitmap of a VBLOCK_BACKUP_F_IMAGE file. The image
+ * follows at *base, rounded up to 4 KiB so it stays block aligned.
+ */
+static int backup_image_hdr(struct vblock_dev *vd, struct file *filp, u64 seq,
+                            loff_t *base, atomic64_t *bytes)
+{
+    size_t len = sizeof(struct vblock_image_hdr) +
+                 BITS_TO_U64(vd->num_regions) * sizeof(u64);
+    struct vblock_image_hdr *hdr;
+    loff_t fpos = 0;
+    ssize_t written;
+
+    hdr = kvzalloc(len, GFP_KERNEL);
+    if (!hdr)
+        return -ENOMEM;
+
+    memcpy(hdr->magic, VBLOCK_IMAGE_MAGIC, sizeof(hdr->magic));
+    hdr->version     = VBLOCK_IMAGE_VERSION;
+    hdr->region_size = vd->region_size;
+    hdr->size        = vd->size;
+    hdr->num_regions = vd->num_regions;
+    hdr->flags       = VBLOCK_IMAGE_F_LOCKS;
+    hdr->data_offset = round_up(len, 4096);
+    hdr->seq         = seq;
+    bitmap_to_arr64((u64 *)(hdr + 1), vd->region_lock_bitmap,
+                    vd->num_regions);
+
+    written = kernel_write(filp, hdr, len, &fpos);
+    *base = hdr->data_offset;
+    kvfree(hdr);
+    if (written != len)
+        return written < 0 ? (int)written : -EIO;
+
+    if (bytes)
+        atomic64_add(written, bytes);
+    return 0;
+}
+
+/* Full image: region i at offset @base + i * region_size. Becomes the
+ * new base for deltas, so each dirty bit is cleared just before its
+ * region is copied; writes during the copy set it again.
+ */
+static int backup_full(struct vblock_dev *vd, struct file *filp, loff_t base,
+                       u8 *tmp, atomic64_t *bytes)
+{
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < vd->num_regions; ++i) {
+        clear_bit(i, vd->backup_dirty);
+        ret = backup_one(vd, filp, &vd->data, i, base + region_start(vd, i),
+                         tmp, i == vd->num_regions - 1, bytes);
+        if (ret)
+            break;
+    }
+
+    /* A failed image is no base: keep everything it consumed dirty */
+    if (ret)
+        while (i >= 0)
+            set_bit(i--, vd->backup_dirty);
+
+    return ret;
+}
+
+/* Delta: header, __u32 index of each included region, then one
+ * region_size payload per index, in the same order.
+ */
+static int backup_delta(struct vblock_dev *vd, struct file *filp, u8 *tmp,
+                        atomic64_t *bytes)
+{
+    struct vblock_delta_hdr hdr;
+    unsigned long *todo;
+    __u32 *index;
+    loff_t fpos = 0;
+    ssize_t written;
+    unsigned int count = 0, k = 0;
+    int ret = 0;
+    int i;
+
+    todo = bitmap_zalloc(vd->num_regions, GFP_KERNEL);
+    index = kvmalloc_array(vd->num_regions, sizeof(*index), GFP_KERNEL);
+    if (!todo || !index) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < vd->num_regions; ++i) {
+        if (test_and_clear_bit(i, vd->backup_dirty) |
+            region_mmap_dirty(vd, i)) {
+            __set_bit(i, todo);
+            index[count++] = i;
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VBLOCK_DELTA_MAGIC, sizeof(hdr.magic));
+    hdr.version     = VBLOCK_DELTA_VERSION;
+    hdr.region_size = vd->region_size;
+    hdr.size        = vd->size;
+    hdr.num_regions = vd->num_regions;
+    hdr.count       = count;
+    hdr.seq         = vd->backup_seq + 1;
+
+    written = kernel_write(filp, &hdr, sizeof(hdr), &fpos);
+    if (written != sizeof(hdr)) {
+        ret = written < 0 ? (int)written : -EIO;
+        goto out_redirty;
+    }
+
+    if (count) {
+        written = kernel_write(filp, index, count * sizeof(*index), &fpos);
+        if (written != count * sizeof(*index)) {
+            ret = written < 0 ? (int)written : -EIO;
+            goto out_redirty;
+        }
+    }
+
+    if (bytes)
+        atomic64_add(fpos, bytes);
+
+    for_each_set_bit(i, todo, vd->num_regions) {
+        ret = backup_one(vd, filp, &vd->data, i,
+                         fpos + (loff_t)k * vd->region_size, tmp,
+                         k == count - 1, bytes);
+        if (ret)
+            break;
+        k++;
+    }
+
+out_redirty:
+    if (ret)
+        for_each_set_bit(i, todo, vd->num_regions)
+            set_bit(i, vd->backup_dirty);
+out:
+    kvfree(index);
+    bitmap_free(todo);
+    return ret;
+}
+
+/* Full image of the snapshot. It stands apart from the delta chain, so
+ * dirty bits and the backup sequence are left alone. Caller holds
+ * snap_rwsem shared.
+ */
+static int backup_snapshot(struct vblock_dev *vd, struct file *filp,
+                           loff_t base, u8 *tmp, atomic64_t *bytes)
+{
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < vd->num_regions && !ret; ++i)
+        ret = backup_one(vd, filp, NULL, i, base + region_start(vd, i), tmp,
+                         i == vd->num_regions - 1, bytes);
+
+    return ret;
+}
+
+static bool backup_flags_valid(u32 flags)
+{
+    if (flags & ~(VBLOCK_BACKUP_F_INCREMENTAL | VBLOCK_BACKUP_F_SNAPSHOT |
+                  VBLOCK_BACKUP_F_IMAGE))
+        return false;
+
+    /* A snapshot has no dirty tracking of its own, and a delta has its
+     * own header
+     */
+    return !((flags & VBLOCK_BACKUP_F_INCREMENTAL) &&
+             (flags & (VBLOCK_BACKUP_F_SNAPSHOT | VBLOCK_BACKUP_F_IMAGE)));
+}
+
+/* Write a full image, a delta of the regions changed since the last
+ * backup (VBLOCK_BACKUP_F_INCREMENTAL) or an image of the snapshot
+ * (VBLOCK_BACKUP_F_SNAPSHOT) into an already opened file, adding to
+ * @bytes (if set) as data is written. Full images get a header with
+ * VBLOCK_BACKUP_F_IMAGE.
+ */
+static int vblock_backup_file(struct vblock_dev *vd, struct file *filp,
+                              u32 flags, atomic64_t *bytes)
+{
+    u64 t0 = local_clock();
+    loff_t base = 0;
+    u64 t1;
+    int ret;
+    u8 *tmp;
+
+    tmp = kvmalloc(VBLOCK_BACKUP_CHUNK, GFP_KERNEL);
+    if (!tmp)
+        return -ENOMEM;
+
+    if (flags & VBLOCK_BACKUP_F_SNAPSHOT) {
+        down_read(&vd->snap_rwsem);
+        trace_vblock_backup_phase(vd->id, VBLOCK_BACKUP_PHASE_WAIT, flags, 0,
+                                  t0);
+        t1 = local_clock();
+        ret = vd->snap_active ? 0 : -ENOENT;
+        if (!ret && (flags & VBLOCK_BACKUP_F_IMAGE))
+            ret = backup_image_hdr(vd, filp, READ_ONCE(vd->backup_seq),
+                                   &base, bytes);
+        if (!ret)
+            ret = backup_snapshot(vd, filp, base, tmp, bytes);
+        up_read(&vd->snap_rwsem);
+        goto out;
+    }
+
+    mutex_lock(&vd->backup_mutex);
+    trace_vblock_backup_phase(vd->id, VBLOCK_BACKUP_PHASE_WAIT, flags, 0, t0);
+    t1 = local_clock();
+
+    if (flags & VBLOCK_BACKUP_F_INCREMENTAL) {
+        ret = backup_delta(vd, filp, tmp, bytes);
+    } else {
+        ret = 0;
+        if (flags & VBLOCK_BACKUP_F_IMAGE)
+            ret = backup_image_hdr(vd, filp, vd->backup_seq + 1, &base, bytes);
+        if (!ret)
+            ret = backup_full(vd, filp, base, tmp, bytes);
+    }
+
+    if (!ret)
+        vd->backup_seq++;
+
+    mutex_unlock(&vd->backup_mutex);
+out:
+    trace_vblock_backup_phase(vd->id, VBLOCK_BACKUP_PHASE_COPY, flags, ret, t1);
+    kvfree(tmp);
+    if (!ret)
+        lat_record(vd, VBLOCK_LAT_BACKUP, t0);
+    return ret;
+}
+
+/* Synchronous backup with VBLOCK_BACKUP_F_* flags */
+static int vblock_backup_path(struct vblock_dev *vd, const char *path,
+                              u32 flags)
+{
+    struct file *filp;
+    u64 t0;
+    int ret;
+
+    t0 = trace_vblock_backup_phase_enabled() ? local_clock() : 0;
+    filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    trace_vblock_backup_phase(vd->id, VBLOCK_BACKUP_PHASE_OPEN, flags,
+                              PTR_ERR_OR_ZERO(filp), t0);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+
+    ret = vblock_backup_file(vd, filp, flags, NULL);
+
+    t0 = trace_vblock_backup_phase_enabled() ? local_clock() : 0;
+    filp_close(filp, NULL);
+    trace_vblock_backup_phase(vd->id, VBLOCK_BACKUP_PHASE_CLOSE, flags, 0, t0);
+    return ret;
+}
+
+int vblock_backup_to_file(const char *path)
+{
+    if (!path)
+        return -EINVAL;
+
+    if (!vblock_devs[0])
+        return -ENODEV;
+
+    return vblock_backup_path(vblock_devs[0], path, 0);
+}
+EXPORT_SYMBOL(vblock_backup_to_file);
+
+/* --- Restore --------------------------------------------------------
+ *
+ * VBLOCK_RESTORE and the restore= parameter load an image (with or
+ * without the VBLOCK_IMAGE header) or apply a delta. The file is read
+ * in order, VBLOCK_RESTORE_CHUNK at a time, and read-ahead is asked for
+ * the next chunk before the current one is copied in, so the disk is
+ * busy while we copy. The file's page cache is dropped at the end; it
+ * won't be read again. All-zero pages are not stored, so a sparse image
+ * restores sparse and an image of a mostly empty device loads at the
+ * speed the file system can skip holes.
+ *
+ * Each region is replaced inside its writer section, so readers see it
+ * either before or after. Restores are serialized with backups by
+ * backup_mutex; restored regions are dirty for the next delta.
+ */
+
+#define VBLOCK_RESTORE_CHUNK  (4UL << 20)
+
+static int restore_read(struct file *filp, void *buf, size_t len, loff_t pos)
+{
+    while (len) {
+        ssize_t n = kernel_read(filp, buf, len, &pos);
+
+        if (n < 0)
+            return n;
+        if (!n)
+            return -EIO;    /* truncated since we checked its size */
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Replace all of @region with @buf */
+static int region_restore(struct vblock_dev *vd, int region, const u8 *buf)
+{
+    loff_t start = region_start(vd, region);
+    size_t off, n;
+    bool mapped;
+    int ret;
+
+    region_write_begin(vd, region);
+    ret = __region_thaw(vd, region, GFP_KERNEL);
+    if (!ret)
+        ret = region_cow(vd, region, GFP_KERNEL);
+    if (ret)
+        goto out;
+
+    /* As in region_discard(): pages may only be freed while unmapped.
+     * Lockless readers pin what they copy from (store_lookup()) and
+     * retry on the writer section, so dropping pages here is safe.
+     */
+    mapped = region_fence_maps(vd, region);
+    for (off = 0; off < vd->region_size && !ret; off += n) {
+        n = min_t(size_t, vd->region_size - off,
+                  PAGE_SIZE - offset_in_page(start + off));
+
+        if (memchr_inv(buf + off, 0, n))
+            ret = store_write_kernel(&vd->data, start + off, buf + off, n);
+        else if (mapped || n < PAGE_SIZE)
+            store_zero(&vd->data, start + off, n);
+        else
+            store_drop_range(&vd->data, start + off, n);
+    }
+    clear_bit(region, vd->region_erased);
+
+    if (!ret)
+        ret = region_mirror(vd, region, start, vd->region_size, GFP_KERNEL);
+    region_changed(vd, region);
+    region_stat_io(vd, region, true, vd->region_size);
+
+    /* The image is at hand, so the next backup has a sum to check */
+    if (!ret && READ_ONCE(vblock_csum))
+        __region_csum_check(vd, region, region_csum_stamp(vd, region),
+                            crc32c(~0U, buf, vd->region_size));
+out:
+    region_write_end(vd, region);
+    return ret;
+}
+
+/* Restore @nr regions whose payloads follow each other from @pos: the
+ * regions listed in @index, or 0..nr-1 without one.
+ */
+static int restore_regions(struct vblock_dev *vd, struct file *filp, loff_t pos,
+                           const __u32 *index, unsigned int nr, u8 *buf,
+                           unsigned int *restored)
+{
+    unsigned int per = max_t(unsigned int, 1,
+                             VBLOCK_RESTORE_CHUNK / vd->region_size);
+    unsigned int k, j, n;
+    int ret = 0;
+
+    for (k = 0; k < nr && !ret; k += n) {
+        size_t len;
+
+        n = min(per, nr - k);
+        len = (size_t)n * vd->region_size;
+
+        if (k + n < nr)
+            vfs_fadvise(filp, pos + len,
+                        (size_t)min(per, nr - k - n) * vd->region_size,
+                        POSIX_FADV_WILLNEED);
+
+        ret = restore_read(filp, buf, len, pos);
+        for (j = 0; j < n && !ret; ++j) {
+            ret = region_restore(vd, index ? index[k + j] : k + j,
+                                 buf + (size_t)j * vd->region_size);
+            if (!ret)
+                (*restored)++;
+        }
+
+        pos += len;
+        if (!ret && fatal_signal_pending(current))
+            ret = -EINTR;
+        cond_resched();
+    }
+    return ret;
+}
+
+/* Set the region locks from @locks. Regions with a writable mapping are
+ * left unlocked, as VBLOCK_LOCK_REGION would refuse them.
+ */
+static void restore_locks(struct vblock_dev *vd, const unsigned long *locks)
+{
+    int busy = 0;
+    int i;
+
+    for (i = 0; i < vd->num_regions; ++i) {
+        region_lock(vd, i);
+        if (!test_bit(i, locks)) {
+            unlock_region_bit(vd, i);
+        } else {
+            spin_lock(&vd->map_lock);
+            if (vd->region_wmaps[i])
+                busy++;
+            else
+                lock_region_bit(vd, i);
+            spin_unlock(&vd->map_lock);
+        }
+        mutex_unlock(&vd->region_mutex[i]);
+    }
+
+    if (busy)
+        pr_warn("vblock%d: restore left %d mapped regions unlocked\n",
+                vd->id, busy);
+}
+
+static bool restore_geometry_ok(struct vblock_dev *vd, u32 region_size,
+                                u64 size, u32 num_regions)
+{
+    return region_size == vd->region_size && size == vd->size &&
+           num_regions == vd->num_regions;
+}
+
+static int restore_image_file(struct vblock_dev *vd, struct file *filp,
+                              const struct vblock_image_hdr *hdr,
+                              loff_t isize, u32 flags, u8 *buf,
+                              unsigned int *restored)
+{
+    size_t words = BITS_TO_U64(vd->num_regions);
+    unsigned long *locks = NULL;
+    u64 *map = NULL;
+    int ret;
+
+    if (hdr->version != VBLOCK_IMAGE_VERSION ||
+        !restore_geometry_ok(vd, hdr->region_size, hdr->size,
+                             hdr->num_regions) ||
+        hdr->data_offset < sizeof(*hdr) + words * sizeof(u64) ||
+        hdr->data_offset > isize || isize - hdr->data_offset < vd->size)
+        return -EINVAL;
+
+    if ((flags & VBLOCK_RESTORE_F_LOCKS) &&
+        (hdr->flags & VBLOCK_IMAGE_F_LOCKS)) {
+        map = kvmalloc_array(words, sizeof(*map), GFP_KERNEL);
+        locks = bitmap_zalloc(vd->num_regions, GFP_KERNEL);
+        ret = map && locks ? 0 : -ENOMEM;
+        if (!ret)
+            ret = restore_read(filp, map, words * sizeof(*map), sizeof(*hdr));
+        if (ret)
+            goto out;
+        bitmap_from_arr64(locks, map, vd->num_regions);
+    }
+
+    ret = restore_regions(vd, filp, hdr->data_offset, NULL, vd->num_regions,
+                          buf, restored);
+    if (!ret && locks)
+        restore_locks(vd, locks);
+    /* Deltas taken after this image follow on from its sequence */
+    if (!ret)
+        vd->backup_seq = hdr->seq;
+out:
+    bitmap_free(locks);
+    kvfree(map);
+    return ret;
+}
+
+static int restore_delta_file(struct vblock_dev *vd, struct file *filp,
+                              const struct vblock_delta_hdr *hdr,
+                              loff_t isize, u8 *buf, unsigned int *restored)
+{
+    loff_t data;
+    __u32 *index;
+    unsigned int k;
+    int ret;
+
+    if (hdr->version != VBLOCK_DELTA_VERSION ||
+        !restore_geometry_ok(vd, hdr->region_size, hdr->size,
+                             hdr->num_regions) ||
+        hdr->count > vd->num_regions)
+        return -EINVAL;
+
+    /* Deltas apply in order: a gap, a repeat or a stale one is refused */
+    if (hdr->seq != vd->backup_seq + 1)
+        return -EINVAL;
+
+    data = sizeof(*hdr) + (loff_t)hdr->count * sizeof(*index);
+    if (isize < data + (loff_t)hdr->count * vd->region_size)
+        return -EINVAL;
+    if (!hdr->count) {
+        vd->backup_seq = hdr->seq;
+        return 0;
+    }
+
+    index = kvmalloc_array(hdr->count, sizeof(*index), GFP_KERNEL);
+    if (!index)
+        return -ENOMEM;
+
+    ret = restore_read(filp, index, hdr->count * sizeof(*index),
+                       sizeof(*hdr));
+    for (k = 0; k < hdr->count && !ret; ++k)
+        if (index[k] >= vd->num_regions)
+            ret = -EINVAL;
+    if (!ret)
+        ret = restore_regions(vd, filp, data, index, hdr->count, buf, restored);
+    if (!ret)
+        vd->backup_seq = hdr->seq;
+
+    kvfree(index);
+    return ret;
+}
+
+/* Load an image or delta from an opened file, counting the regions
+ * written in @restored. On error the regions before the failing one
+ * are already replaced.
+ */
+static int vblock_restore_file(struct vblock_dev *vd, struct file *filp,
+                               u32 flags, unsigned int *restored)
+{
+    union {
+        struct vblock_image_hdr img;
+        struct vblock_delta_hdr delta;
+    } hdr;
+    loff_t isize = i_size_read(file_inode(filp));
+    unsigned int per = max_t(unsigned int, 1,
+                             VBLOCK_RESTORE_CHUNK / vd->region_size);
+    int ret;
+    u8 *buf;
+
+    buf = kvmalloc((size_t)per * vd->region_size, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    vfs_fadvise(filp, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    memset(&hdr, 0, sizeof(hdr));
+    ret = restore_read(filp, &hdr, min_t(loff_t, sizeof(hdr), isize), 0);
+    if (ret)
+        goto out;
+
+    mutex_lock(&vd->backup_mutex);
+    if (flags & VBLOCK_RESTORE_F_RAW) {
+        ret = -EINVAL;
+        if (isize == vd->size)
+            ret = restore_regions(vd, filp, 0, NULL, vd->num_regions, buf,
+                                  restored);
+    } else if (!memcmp(hdr.img.magic, VBLOCK_IMAGE_MAGIC,
+                     sizeof(hdr.img.magic)))
+        ret = restore_image_file(vd, filp, &hdr.img, isize, flags, buf,
+                                 restored);
+    else if (!memcmp(hdr.delta.magic, VBLOCK_DELTA_MAGIC,
+                     sizeof(hdr.delta.magic)))
+        ret = restore_delta_file(vd, filp, &hdr.delta, isize, buf, restored);
+    else
+        ret = -EINVAL;
+    mutex_unlock(&vd->backup_mutex);
+out:
+    vfs_fadvise(filp, 0, 0, POSIX_FADV_DONTNEED);
+    kvfree(buf);
+    return ret;
+}
+
+static int vblock_restore_path(struct vblock_dev *vd, const char *path,
+                               u32 flags, unsigned int *restored)
+{
+    u64 t0 = ktime_get_ns();
+    struct file *filp;
+    int ret;
+
+    *restored = 0;
+    filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+
+    if (S_ISREG(file_inode(filp)->i_mode))
+        ret = vblock_restore_file(vd, filp, flags, restored);
+    else
+        ret = -EINVAL;
+    filp_close(filp, NULL);
+
+    if (!ret)
+        pr_info("vblock%d: restored %u regions from %s in %llu ms\n",
+                vd->id, *restored, path, (ktime_get_ns() - t0) / NSEC_PER_MSEC);
+    return ret;
+}
+
+/* --- Asynchronous backup jobs ----------------------------------------
+ *
+ * VBLOCK_BACKUP_ASYNC opens the target in the caller's context (so the
+ * caller's credentials apply), queues the job on vblock_backup_wq and
+ * returns its id. Completion is reported through poll() on the
+ * descriptor that queued it (EPOLLPRI until reaped), an optional
+ * eventfd, and VBLOCK_BACKUP_STATUS.
+ *
+ * Jobs live in their device's jobs xarray until reaped. If the owning descriptor is
+ * closed first, the job finishes and frees itself.
+ */
+
+struct vblock_backup_job {
+    u32 id;
+    struct vblock_dev *vd;
+    struct work_struct work;
+    struct file *filp;
+    struct eventfd_ctx *efd;
+    struct vblock_file *owner;  /* NULL once the owner has closed */
+    u32 flags;                  /* VBLOCK_BACKUP_F_* */
+    u32 state;                  /* VBLOCK_JOB_* */
+    int error;
+    atomic64_t bytes;
+    ktime_t start, end;
+};
+
+static struct workqueue_struct *vblock_backup_wq;
+
+static void vblock_job_free(struct vblock_backup_job *job)
+{
+    if (job->efd)
+        eventfd_ctx_put(job->efd);
+    kfree(job);
+}
+
+static void vblock_backup_work(struct work_struct *work)
+{
+    struct vblock_backup_job *job =
+        container_of(work, struct vblock_backup_job, work);
+    struct vblock_dev *vd = job->vd;
+    bool orphan;
+    int ret;
+
+    mutex_lock(&vd->job_mutex);
+    job->state = VBLOCK_JOB_RUNNING;
+    job->start = ktime_get();
+    mutex_unlock(&vd->job_mutex);
+
+    ret = vblock_backup_file(vd, job->filp, job->flags, &job->bytes);
+    filp_close(job->filp, NULL);
+    job->filp = NULL;
+
+    mutex_lock(&vd->job_mutex);
+    job->error = ret;
+    job->end = ktime_get();
+    job->state = VBLOCK_JOB_DONE;
+    if (job->efd)
+        eventfd_signal(job->efd);
+    orphan = !job->owner;
+    if (orphan)
+        xa_erase(&vd->jobs, job->id);
+    else
+        job->owner->jobs_done++;
+    mutex_unlock(&vd->job_mutex);
+
+    if (orphan)
+        vblock_job_free(job);
+    else
+        wake_up_interruptible_poll(&vd->job_wq, EPOLLPRI);
+}
+
+static long vblock_backup_async(struct vblock_file *vf, void __user *argp)
+{
+    struct vblock_dev *vd = vf->vd;
+    struct vblock_backup_req req;
+    struct vblock_backup_job *job;
+    int ret;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+
+    if (!backup_flags_valid(req.flags))
+        return -EINVAL;
+    req.path[sizeof(req.path) - 1] = '\0';
+
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    if (!job)
+        return -ENOMEM;
+
+    INIT_WORK(&job->work, vblock_backup_work);
+    job->flags = req.flags;
+    atomic64_set(&job->bytes, 0);
+    job->state = VBLOCK_JOB_QUEUED;
+    job->owner = vf;
+    job->vd = vd;
+
+    if (req.eventfd >= 0) {
+        job->efd = eventfd_ctx_fdget(req.eventfd);
+        if (IS_ERR(job->efd)) {
+            ret = PTR_ERR(job->efd);
+            job->efd = NULL;
+            goto err_free;
+        }
+    }
+
+    job->filp = filp_open(req.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (IS_ERR(job->filp)) {
+        ret = PTR_ERR(job->filp);
+        goto err_free;
+    }
+
+    ret = xa_alloc_cyclic(&vd->jobs, &job->id, job, xa_limit_32b,
+                          &vd->next_job, GFP_KERNEL);
+    if (ret < 0)
+        goto err_close;
+
+    req.job_id = job->id;
+    if (copy_to_user(argp, &req, sizeof(req))) {
+        xa_erase(&vd->jobs, job->id);
+        ret = -EFAULT;
+        goto err_close;
+    }
+
+    queue_work(vblock_backup_wq, &job->work);
+    return 0;
+
+err_close:
+    filp_close(job->filp, NULL);
+err_free:
+    vblock_job_free(job);
+    return ret;
+}
+
+static long vblock_backup_status(struct vblock_file *vf, void __user *argp)
+{
+    struct vblock_dev *vd = vf->vd;
+    struct vblock_backup_status st;
+    struct vblock_backup_job *job;
+    bool reap = false;
+
+    if (copy_from_user(&st, argp, sizeof(st)))
+        return -EFAULT;
+
+    if (st.flags & ~VBLOCK_JOB_F_REAP)
+        return -EINVAL;
+
+    mutex_lock(&vd->job_mutex);
+
+    job = xa_load(&vd->jobs, st.job_id);
+    if (!job || job->owner != vf) {
+        mutex_unlock(&vd->job_mutex);
+        return -ENOENT;
+    }
+
+    st.state = job->state;
+    st.error = job->error;
+    st.bytes = atomic64_read(&job->bytes);
+    if (job->state == VBLOCK_JOB_QUEUED)
+        st.elapsed_ns = 0;
+    else
+        st.elapsed_ns = ktime_to_ns(ktime_sub(job->state == VBLOCK_JOB_DONE ?
+                                              job->end : ktime_get(),
+                                              job->start));
+
+    if ((st.flags & VBLOCK_JOB_F_REAP) && job->state == VBLOCK_JOB_DONE) {
+        xa_erase(&vd->jobs, job->id);
+        vf->jobs_done--;
+        reap = true;
+    }
+
+    mutex_unlock(&vd->job_mutex);
+
+    if (reap)
+        vblock_job_free(job);
+
+    if (copy_to_user(argp, &st, sizeof(st)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/* Owner is going away: free finished jobs, orphan the rest */
+static void vblock_jobs_release(struct vblock_file *vf)
+{
+    struct vblock_dev *vd = vf->vd;
+    struct vblock_backup_job *job;
+    unsigned long id;
+
+    mutex_lock(&vd->job_mutex);
+    xa_for_each(&vd->jobs, id, job) {
+        if (job->owner != vf)
+            continue;
+
+        if (job->state == VBLOCK_JOB_DONE) {
+            xa_erase(&vd->jobs, id);
+            vblock_job_free(job);
+        } else {
+            job->owner = NULL;
+        }
+    }
+    mutex_unlock(&vd->job_mutex);
+}
+
+/* EPOLLPRI: a backup job finished. EPOLLIN: a watched region changed;
+ * epoll only waits on the watch queues the mask touched when the file
+ * was added.
+ */
+static __poll_t vblock_poll(struct file *filp, poll_table *wait)
+{
+    struct vblock_file *vf = filp->private_data;
+    struct vblock_dev *vd = vf->vd;
+    u64 shards = READ_ONCE(vf->watch_shards);
+    __poll_t mask = 0;
+    int i;
+
+    poll_wait(filp, &vd->job_wq, wait);
+    for (i = 0; shards; ++i, shards >>= 1)
+        if (shards & 1)
+            poll_wait(filp, &vd->watch_wq[i], wait);
+
+    if (READ_ONCE(vf->jobs_done))
+        mask |= EPOLLPRI;
+    if (watch_pending(vd, vf))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
+/* --- File operations table ----------------------------------------- */
+
+static const struct file_operations vblock_fops = {
+    .owner          = THIS_MODULE,
+    .open           = vblock_open,
+    .release        = vblock_release,
+    .read_iter      = vblock_read_iter,
+    .write_iter     = vblock_write_iter,
+    .unlocked_ioctl = vblock_ioctl,
+    .mmap           = vblock_mmap,
+    .poll           = vblock_poll,
+    .llseek         = vblock_llseek,
+};
+
+/* --- Block device ---------------------------------------------------
+ *
+ * /dev/vblkN exposes the same store through blk-mq. Requests follow the
+ * character device rules: reads are lockless per region, writes hold
+ * the region mutex and fail on a locked region, since a bio carries
+ * no key.
+ */
 
-    if (count > 1023) /* arbitrary sanity limit */
-        return -EINVAL;
+static int vblock_blk_xfer(struct vblock_dev *vd, loff_t pos, void *buf,
+                           size_t len, bool write)
+{
+    int ret = 0;
 
-    kbuf = kzalloc(count + 1, GFP_KERNEL);
-    if (!kbuf)
-        return -ENOMEM;
+    while (len && !ret) {
+        int region = pos / vd->region_size;
+        size_t chunk = min_t(u64, len,
+                             region_start(vd, region) + vd->region_size - pos);
 
-    if (copy_from_user(kbuf, buf, count)) {
-        kfree(kbuf);
-        return -EFAULT;
-    }
-    kbuf[count] = '\0';
+        if (!write) {
+            ret = region_read_kernel(vd, &vd->data, region, pos, buf, chunk);
+        } else {
+            u64 t0 = local_clock();
 
-    p = kbuf;
+            region_write_begin(vd, region);
+            if (region_is_locked(vd, region)) {
+                region_stat_add(vd, region, RSTAT_LOCK_FAILS, 1);
+                ret = -EACCES;
+            } else {
+                ret = __region_thaw(vd, region, GFP_KERNEL);
+            }
 
-    /* Split on ':' */
-    first = strsep(&p, ":");
-    if (!first) {
-        ret = -EINVAL;
-        goto out;
-    }
+            if (!ret)
+                ret = region_cow(vd, region, GFP_KERNEL);
 
-    second = strsep(&p, ":");
-    if (!second) {
-        /* Need at least two fields */
-        ret = -EINVAL;
-        goto out;
-    }
+            if (!ret) {
+                ret = vblock_store_write(vd, region, pos, buf, chunk);
+                region_changed(vd, region);
+            }
+            region_write_end(vd, region);
 
-    if (p) {
-        /* Form: key:offset:data */
-        data_str = p;
-        key_present = true;
-        if (kstrtoint(first, 10, &key)) {
-            ret = -EINVAL;
-            goto out;
-        }
-        if (kstrtouint(second, 10, &offset)) {
-            ret = -EINVAL;
-            goto out;
-        }
-    } else {
-        /* Form: offset:data (no key) */
-        data_str = second;
-        key_present = false;
-        if (kstrtouint(first, 10, &offset)) {
-            ret = -EINVAL;
-            goto out;
+            if (!ret) {
+                region_stat_io(vd, region, true, chunk);
+                lat_record(vd, VBLOCK_LAT_WRITE, t0);
+            }
+            trace_vblock_write(vd->id, region, region, pos, chunk, ret, t0);
         }
+
+        pos += chunk;
+        buf += chunk;
+        len -= chunk;
     }
+    return ret;
+}
 
-    data_len = strlen(data_str);
+static blk_status_t vblock_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                    const struct blk_mq_queue_data *bd)
+{
+    struct vblock_dev *vd = hctx->queue->queuedata;
+    struct request *rq = bd->rq;
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    bool write = op_is_write(req_op(rq));
+    blk_status_t status = BLK_STS_OK;
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    unsigned int noio;
 
-    if (offset >= VBLOCK_SIZE) {
-        ret = -EINVAL;
-        goto out;
-    }
-    if (data_len == 0) {
-        ret = 0;
+    blk_mq_start_request(rq);
+
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        break;
+    case REQ_OP_FLUSH:
+        goto out;   /* nothing is cached */
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        if (pos + blk_rq_bytes(rq) > vd->size) {
+            status = BLK_STS_IOERR;
+        } else {
+            noio = memalloc_noio_save();
+            /* A bio has no session, so locked regions refuse it */
+            status = errno_to_blk_status(vblock_discard(vd, pos,
+                                                        blk_rq_bytes(rq),
+                                                        NULL));
+            memalloc_noio_restore(noio);
+        }
         goto out;
-    }
-    if (offset + data_len > VBLOCK_SIZE) {
-        /* prevent overrun */
-        ret = -EINVAL;
+    default:
+        status = BLK_STS_NOTSUPP;
         goto out;
     }
 
-    /* Region boundary check: reject writes that cross regions */
-    region = offset / VBLOCK_REGION_SIZE;
-    if (((offset + data_len - 1) / VBLOCK_REGION_SIZE) != region) {
-        /* Either reject or implement region-splitting; we choose reject. */
-        ret = -EINVAL;
+    if (pos + blk_rq_bytes(rq) > vd->size) {
+        status = BLK_STS_IOERR;
         goto out;
     }
 
-    /* Check lock + key logic */
-    if (region_is_locked(region)) {
-        if (!key_present || !key_is_authorized(key)) {
-            ret = -EACCES; /* or -EPERM */
-            goto out;
+    /* Page allocation here must not recurse into block I/O */
+    noio = memalloc_noio_save();
+    rq_for_each_segment(bvec, rq, iter) {
+        void *buf = bvec_kmap_local(&bvec);
+        int err = vblock_blk_xfer(vd, pos, buf, bvec.bv_len, write);
+
+        kunmap_local(buf);
+        if (err) {
+            status = errno_to_blk_status(err);
+            break;
         }
+        pos += bvec.bv_len;
     }
+    memalloc_noio_restore(noio);
 
-    /* Now do the actual write with region-level locking */
-    mutex_lock(&region_mutex[region]);
+out:
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
+}
 
-    memcpy(&vblock_data[offset], data_str, data_len);
+static const struct blk_mq_ops vblock_mq_ops = {
+    .queue_rq = vblock_queue_rq,
+};
 
-    if (mirror_enable)
-        memcpy(&vblock_mirror[offset], data_str, data_len);
+static const struct block_device_operations vblock_bdops = {
+    .owner = THIS_MODULE,
+};
 
-    mutex_unlock(&region_mutex[region]);
+/* The disk of @vd, /dev/vblkN; the major is registered at load */
+static int vblock_blk_init(struct vblock_dev *vd)
+{
+    struct queue_limits lim = {
+        .logical_block_size       = SECTOR_SIZE,
+        .max_hw_discard_sectors   = UINT_MAX >> SECTOR_SHIFT,
+        .max_write_zeroes_sectors = UINT_MAX >> SECTOR_SHIFT,
+    };
+    int ret;
 
-    /* We report full count consumed (what user wrote) */
-    *ppos = offset + data_len;
-    ret = count;
+    vd->tag_set.ops = &vblock_mq_ops;
+    vd->tag_set.nr_hw_queues = nr_queues ? nr_queues : nr_cpu_ids;
+    vd->tag_set.queue_depth = queue_depth;
+    vd->tag_set.numa_node = NUMA_NO_NODE;
+    /* queue_rq sleeps on region mutexes and page allocation */
+    vd->tag_set.flags = BLK_MQ_F_BLOCKING;
 
-out:
-    kfree(kbuf);
-    return ret;
-}
+    ret = blk_mq_alloc_tag_set(&vd->tag_set);
+    if (ret)
+        return ret;
 
-/* --- IOCTL Handler ------------------------------------------------- */
+    vd->disk = blk_mq_alloc_disk(&vd->tag_set, &lim, vd);
+    if (IS_ERR(vd->disk)) {
+        ret = PTR_ERR(vd->disk);
+        goto err_tag_set;
+    }
 
-static long vblock_ioctl(struct file *filp,
-                         unsigned int cmd, unsigned long arg)
-{
-    int region;
-    int __user *argp_int = (int __user *)arg;
+    vd->disk->major = vblk_major;
+    vd->disk->first_minor = vd->id;
+    vd->disk->minors = 1;
+    vd->disk->fops = &vblock_bdops;
+    vd->disk->private_data = vd;
+    snprintf(vd->disk->disk_name, DISK_NAME_LEN, BLK_NAME "%d", vd->id);
+    set_capacity(vd->disk, vd->size >> SECTOR_SHIFT);
 
-    switch (cmd) {
+    ret = add_disk(vd->disk);
+    if (ret)
+        goto err_disk;
 
-    case VBLOCK_LOCK_REGION:
-        if (get_user(region, argp_int))
-            return -EFAULT;
-        if (region < 0 || region >= VBLOCK_NUM_REGIONS)
-            return -EINVAL;
+    return 0;
 
-        mutex_lock(&region_mutex[region]);
-        lock_region_bit(region);
-        mutex_unlock(&region_mutex[region]);
-        return 0;
+err_disk:
+    put_disk(vd->disk);
+err_tag_set:
+    blk_mq_free_tag_set(&vd->tag_set);
+    return ret;
+}
 
-    case VBLOCK_UNLOCK_REGION:
-        if (get_user(region, argp_int))
-            return -EFAULT;
-        if (region < 0 || region >= VBLOCK_NUM_REGIONS)
-            return -EINVAL;
+static void vblock_blk_exit(struct vblock_dev *vd)
+{
+    del_gendisk(vd->disk);
+    put_disk(vd->disk);
+    blk_mq_free_tag_set(&vd->tag_set);
+}
 
-        mutex_lock(&region_mutex[region]);
-        unlock_region_bit(region);
-        mutex_unlock(&region_mutex[region]);
-        return 0;
+/* --- Init / Exit --------------------------------------------------- */
 
-    case VBLOCK_READ_REGION: {
-        struct vblock_region kregion;
+static void vblock_regions_free(struct vblock_dev *vd)
+{
+    int cpu;
 
-        if (copy_from_user(&kregion, (void __user *)arg, sizeof(kregion)))
-            return -EFAULT;
+    bitmap_free(vd->region_lock_bitmap);
+    bitmap_free(vd->backup_dirty);
+    bitmap_free(vd->snap_preserved);
+    bitmap_free(vd->mirror_dirty);
+    kvfree(vd->region_meta);
+    kvfree(vd->region_mutex);
+    kvfree(vd->region_seq);
+    kvfree(vd->region_gen);
+    kvfree(vd->region_wmaps);
+    kvfree(vd->mirror_pending);
+    kvfree(vd->mirror_since);
+    kvfree(vd->region_z);
+    bitmap_free(vd->region_cold);
+    bitmap_free(vd->region_ref);
+    bitmap_free(vd->region_erased);
+    kvfree(vd->region_csum);
+    bitmap_free(vd->region_csum_valid);
+    kvfree(vd->region_event);
+    kvfree(vd->region_watchers);
 
-        if (kregion.region_index >= VBLOCK_NUM_REGIONS)
-            return -EINVAL;
+    if (vd->rstats) {
+        for_each_possible_cpu(cpu)
+            kvfree(*per_cpu_ptr(vd->rstats, cpu));
+        free_percpu(vd->rstats);
+    }
+    free_percpu(vd->lat);
+    free_percpu(vd->z_accesses);
+}
 
-        /* Coordinate bulk region reads via semaphore */
-        if (down_interruptible(&vblock_read_sem))
-            return -ERESTARTSYS;
+/* Size every per-region array and bitmap for @n regions */
+static int vblock_regions_alloc(struct vblock_dev *vd, unsigned int n)
+{
+    unsigned int i;
+    int cpu;
 
-        mutex_lock(&region_mutex[kregion.region_index]);
-        memcpy(kregion.data,
-               &vblock_data[kregion.region_index * VBLOCK_REGION_SIZE],
-               VBLOCK_REGION_SIZE);
-        mutex_unlock(&region_mutex[kregion.region_index]);
+    vd->region_lock_bitmap = bitmap_zalloc(n, GFP_KERNEL);
+    vd->backup_dirty       = bitmap_zalloc(n, GFP_KERNEL);
+    vd->snap_preserved     = bitmap_zalloc(n, GFP_KERNEL);
+    vd->mirror_dirty       = bitmap_zalloc(n, GFP_KERNEL);
+    vd->region_meta        = kvcalloc(n, sizeof(*vd->region_meta), GFP_KERNEL);
+    vd->region_mutex       = kvcalloc(n, sizeof(*vd->region_mutex), GFP_KERNEL);
+    vd->region_seq         = kvcalloc(n, sizeof(*vd->region_seq), GFP_KERNEL);
+    vd->region_gen         = kvcalloc(n, sizeof(*vd->region_gen), GFP_KERNEL);
+    vd->region_wmaps       = kvcalloc(n, sizeof(*vd->region_wmaps), GFP_KERNEL);
+    vd->mirror_pending     = kvcalloc(n, sizeof(u64), GFP_KERNEL);
+    vd->mirror_since       = kvcalloc(n, sizeof(u64), GFP_KERNEL);
+    vd->region_z           = kvcalloc(n, sizeof(*vd->region_z), GFP_KERNEL);
+    vd->region_cold        = bitmap_zalloc(n, GFP_KERNEL);
+    vd->region_ref         = bitmap_zalloc(n, GFP_KERNEL);
+    vd->region_erased      = bitmap_zalloc(n, GFP_KERNEL);
+    vd->region_csum        = kvcalloc(n, sizeof(*vd->region_csum), GFP_KERNEL);
+    vd->region_csum_valid  = bitmap_zalloc(n, GFP_KERNEL);
+    vd->region_event       = kvcalloc(n, sizeof(u64), GFP_KERNEL);
+    vd->region_watchers    = kvcalloc(n, sizeof(atomic_t), GFP_KERNEL);
+    vd->rstats             = alloc_percpu(u64 *);
+    vd->lat                = alloc_percpu(struct vblock_latency);
+    vd->z_accesses         = alloc_percpu(u64);
 
-        up(&vblock_read_sem);
+    if (!vd->region_lock_bitmap || !vd->backup_dirty ||
+        !vd->snap_preserved || !vd->mirror_dirty || !vd->region_meta ||
+        !vd->region_mutex || !vd->region_seq || !vd->region_gen ||
+        !vd->region_wmaps || !vd->mirror_pending || !vd->mirror_since ||
+        !vd->region_z || !vd->region_cold || !vd->region_ref ||
+        !vd->region_erased || !vd->region_csum || !vd->region_csum_valid ||
+        !vd->region_event || !vd->region_watchers || !vd->rstats ||
+        !vd->lat || !vd->z_accesses) {
+        vblock_regions_free(vd);
+        return -ENOMEM;
+    }
 
-        if (copy_to_user((void __user *)arg, &kregion, sizeof(kregion)))
-            return -EFAULT;
+    for_each_possible_cpu(cpu) {
+        u64 *c = kvzalloc_node(array_size(n, RSTAT_NR * sizeof(u64)),
+                               GFP_KERNEL, cpu_to_node(cpu));
 
-        return 0;
+        if (!c) {
+            vblock_regions_free(vd);
+            return -ENOMEM;
+        }
+        *per_cpu_ptr(vd->rstats, cpu) = c;
     }
 
-    case VBLOCK_GET_INFO: {
-        struct vblock_info info;
+    for (i = 0; i < n; ++i) {
+        mutex_init(&vd->region_mutex[i]);
+        seqcount_init(&vd->region_seq[i]);
+        INIT_LIST_HEAD(&vd->region_z[i].lru);
+    }
+    return 0;
+}
 
-        info.size        = VBLOCK_SIZE;
-        info.region_size = VBLOCK_REGION_SIZE;
-        info.num_regions = VBLOCK_NUM_REGIONS;
-        info.lock_bitmap = region_lock_bitmap;
+/* Geometry of device @id from the size= and region_size= arrays: entry
+ * @id, or the last one given
+ */
+static void vblock_param_geometry(unsigned int id, unsigned long *size,
+                                  unsigned int *region_size)
+{
+    *size = dev_size[min_t(int, id, max(nr_dev_size, 1) - 1)];
+    *region_size = dev_region_size[min_t(int, id,
+                                         max(nr_dev_region_size, 1) - 1)];
+}
 
-        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
-            return -EFAULT;
+/* Free a device built by vblock_dev_alloc() that is not, or no longer,
+ * registered
+ */
+static void vblock_dev_free(struct vblock_dev *vd)
+{
+    /* A restore may have queued the workers */
+    cancel_delayed_work_sync(&vd->mirror_work);
+    cancel_work_sync(&vd->reap_work);
+    vblock_compress_exit(vd);
 
-        return 0;
-    }
+    store_free(&vd->data);
+    store_free(&vd->mirror);
+    store_free(&vd->snap);
+    if (vd->data.mapping)
+        iput(vd->data.mapping->host);
+    vblock_keys_exit(vd);
+    vblock_regions_free(vd);
+    percpu_free_rwsem(&vd->snap_freeze);
+    xa_destroy(&vd->jobs);
+    kfree(vd);
+}
 
-case VBLOCK_READ_MIRROR: {
-    struct vblock_region r;
+/* Build device @id and load @image (if set) into it, before anything
+ * can see it
+ */
+static struct vblock_dev *vblock_dev_alloc(int id, unsigned long size,
+                                           unsigned int region_size,
+                                           const char *image)
+{
+    struct vblock_dev *vd;
+    unsigned int restored;
+    int ret, i;
 
-    if (copy_from_user(&r, (void __user *)arg, sizeof(r)))
-        return -EFAULT;
+    if (!size || !region_size || size % region_size) {
+        pr_err("vblock%d: size must be a non-zero multiple of region_size\n",
+               id);
+        return ERR_PTR(-EINVAL);
+    }
 
-    if (r.region_index < 0 || r.region_index >= VBLOCK_NUM_REGIONS)
-        return -EINVAL;
+    /* /dev/vblkN counts whole sectors; a tail would be silently lost */
+    if (size % SECTOR_SIZE) {
+        pr_err("vblock%d: size must be a multiple of %d\n", id, SECTOR_SIZE);
+        return ERR_PTR(-EINVAL);
+    }
+
+    if (size / region_size > VBLOCK_MAX_REGIONS) {
+        pr_err("vblock%d: at most %d regions supported\n", id,
+               VBLOCK_MAX_REGIONS);
+        return ERR_PTR(-EINVAL);
+    }
 
-    mutex_lock(&region_mutex[r.region_index]);
+    vd = kzalloc(sizeof(*vd), GFP_KERNEL);
+    if (!vd)
+        return ERR_PTR(-ENOMEM);
 
-    memcpy(r.data,
-           &vblock_mirror[r.region_index * VBLOCK_REGION_SIZE],
-           VBLOCK_REGION_SIZE);
+    vd->id = id;
+    vd->size = size;
+    vd->region_size = region_size;
+    vd->num_regions = size / region_size;
 
-    mutex_unlock(&region_mutex[r.region_index]);
+    store_init(&vd->data);
+    store_init(&vd->mirror);
+    store_init(&vd->snap);
+    mutex_init(&vd->backup_mutex);
+    xa_init_flags(&vd->jobs, XA_FLAGS_ALLOC1);
+    mutex_init(&vd->job_mutex);
+    init_waitqueue_head(&vd->job_wq);
+    init_rwsem(&vd->snap_rwsem);
+    mutex_init(&vd->snap_mutex);
+    ret = percpu_init_rwsem(&vd->snap_freeze);
+    if (ret)
+        goto err_free;
+    mutex_init(&vd->span_mutex);
+    seqcount_init(&vd->span_seq);
+    spin_lock_init(&vd->map_lock);
+    INIT_DELAYED_WORK(&vd->mirror_work, vblock_mirror_fn);
+    INIT_LIST_HEAD(&vd->hot_lru);
+    spin_lock_init(&vd->lru_lock);
+    INIT_WORK(&vd->compress_work, vblock_compress_fn);
+    INIT_WORK(&vd->reap_work, vblock_reap_fn);
+    mutex_init(&vd->key_mutex);
+    atomic_long_set(&vd->auth_gen, 1);     /* 0 marks a file unstamped */
+    vd->watch_span = DIV_ROUND_UP(vd->num_regions, VBLOCK_WATCH_SHARDS);
+    for (i = 0; i < VBLOCK_WATCH_SHARDS; ++i)
+        init_waitqueue_head(&vd->watch_wq[i]);
 
-    if (copy_to_user((void __user *)arg, &r, sizeof(r)))
-        return -EFAULT;
+    ret = vblock_regions_alloc(vd, vd->num_regions);
+    if (ret)
+        goto err_freeze;
 
-    return 0;
-}
+    ret = vblock_keys_init(vd);
+    if (ret)
+        goto err_regions;
 
-case VBLOCK_BACKUP: {
-    char path[256];
+    ret = vblock_compress_init(vd);
+    if (ret)
+        goto err_keys;
 
-    if (copy_from_user(path, (char __user *)arg, sizeof(path)))
-        return -EFAULT;
+    if (image && *image) {
+        u32 flags = VBLOCK_RESTORE_F_LOCKS;
 
-    path[255] = '\0';
+        if (strstarts(image, "raw:")) {
+            flags = VBLOCK_RESTORE_F_RAW;
+            image += 4;
+        }
+        ret = vblock_restore_path(vd, image, flags, &restored);
+        if (ret) {
+            pr_err("vblock%d: restore from %s failed: %d\n", id, image, ret);
+            vblock_dev_free(vd);
+            return ERR_PTR(ret);
+        }
+    }
+    return vd;
 
-    return vblock_backup_to_file(path);
+err_keys:
+    vblock_keys_exit(vd);
+err_regions:
+    vblock_regions_free(vd);
+err_freeze:
+    percpu_free_rwsem(&vd->snap_freeze);
+err_free:
+    kfree(vd);
+    return ERR_PTR(ret);
 }
 
-    case VBLOCK_ERASE_REGION:
-        if (get_user(region, argp_int))
-            return -EFAULT;
-        if (region < 0 || region >= VBLOCK_NUM_REGIONS)
-            return -EINVAL;
+/* Make @vd visible as /dev/vblockN and /dev/vblkN */
+static int vblock_dev_register(struct vblock_dev *vd)
+{
+    dev_t devt = MKDEV(MAJOR(vblock_devt), vd->id);
+    struct device *dev;
+    int ret;
 
-        mutex_lock(&region_mutex[region]);
+    cdev_init(&vd->cdev, &vblock_fops);
+    vd->cdev.owner = THIS_MODULE;
 
-        memset(&vblock_data[region * VBLOCK_REGION_SIZE], 0,
-               VBLOCK_REGION_SIZE);
+    ret = cdev_add(&vd->cdev, devt, 1);
+    if (ret)
+        return ret;
 
-        if (mirror_enable)
-            memset(&vblock_mirror[region * VBLOCK_REGION_SIZE], 0,
-                   VBLOCK_REGION_SIZE);
+    dev = device_create(vblock_class, NULL, devt, vd, DEVICE_NAME "%d",
+                        vd->id);
+    if (IS_ERR(dev)) {
+        ret = PTR_ERR(dev);
+        goto err_cdev;
+    }
 
-        mutex_unlock(&region_mutex[region]);
+    ret = vblock_blk_init(vd);
+    if (ret)
+        goto err_device;
 
-        return 0;
+    vblock_debugfs_init(vd);
 
-    default:
-        return -ENOTTY;
-    }
-}
+    pr_info("vblock%d: size=%lu regions=%u x %u, keys=%d, %u queues\n",
+            vd->id, vd->size, vd->num_regions, vd->region_size,
+            atomic_read(&vd->keys.nelems), vd->tag_set.nr_hw_queues);
+    return 0;
 
-/* --- Exported backup API -------------------------------------------
- *
- * int vblock_backup_to_file(const char *path)
- *   - path: kernel-space string with absolute path
- *   - returns 0 on success or negative errno
- *
- * This is EXPORT_SYMBOL so other kernel modules can trigger backup.
- */
+err_device:
+    device_destroy(vblock_class, devt);
+err_cdev:
+    cdev_del(&vd->cdev);
+    return ret;
+}
 
-int vblock_backup_to_file(const char *path)
+static void vblock_dev_unregister(struct vblock_dev *vd)
 {
-    struct file *filp;
-    loff_t pos = 0;
-    ssize_t written;
-    int ret = 0;
-    u8 *tmp;
-    int i;
+    debugfs_remove_recursive(vd->debugfs);
+    vblock_blk_exit(vd);
+    device_destroy(vblock_class, MKDEV(MAJOR(vblock_devt), vd->id));
+    cdev_del(&vd->cdev);
+}
 
-    if (!path)
-        return -EINVAL;
+/* Create the next device; returns its id. A zero @size or @region_size
+ * takes the module parameter for that id.
+ */
+static int vblock_dev_create(unsigned long size, unsigned int region_size,
+                             const char *image)
+{
+    unsigned long def_size;
+    unsigned int def_region_size;
+    struct vblock_dev *vd;
+    int id, ret;
 
-    tmp = kmalloc(VBLOCK_SIZE, GFP_KERNEL);
-    if (!tmp)
-        return -ENOMEM;
+    mutex_lock(&vblock_devs_mutex);
+    id = vblock_nr_devs;
+    if (id >= VBLOCK_MAX_DEVICES) {
+        ret = -ENOSPC;
+        goto out;
+    }
 
-    /* Coordinate with VBLOCK_READ_REGION via semaphore
-     * and with writers via per-region mutexes.
-     */
-    if (down_interruptible(&vblock_read_sem)) {
-        kfree(tmp);
-        return -ERESTARTSYS;
+    vblock_param_geometry(id, &def_size, &def_region_size);
+    vd = vblock_dev_alloc(id, size ? size : def_size,
+                          region_size ? region_size : def_region_size, image);
+    if (IS_ERR(vd)) {
+        ret = PTR_ERR(vd);
+        goto out;
     }
 
-    for (i = 0; i < VBLOCK_NUM_REGIONS; ++i) {
-        mutex_lock(&region_mutex[i]);
-        memcpy(tmp + i * VBLOCK_REGION_SIZE,
-               vblock_data + i * VBLOCK_REGION_SIZE,
-               VBLOCK_REGION_SIZE);
-        mutex_unlock(&region_mutex[i]);
+    ret = vblock_dev_register(vd);
+    if (ret) {
+        vblock_dev_free(vd);
+        goto out;
     }
 
-    up(&vblock_read_sem);
+    vblock_devs[id] = vd;
+    vblock_nr_devs++;
+    ret = id;
+out:
+    mutex_unlock(&vblock_devs_mutex);
+    return ret;
+}
+
+/* VBLOCK_DEV_ADD */
+static long vblock_dev_add(void __user *argp)
+{
+    struct vblock_dev_req req;
+    int id;
 
-    filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (IS_ERR(filp)) {
-        ret = PTR_ERR(filp);
-        kfree(tmp);
-        return ret;
-    }
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
 
-    written = kernel_write(filp, tmp, VBLOCK_SIZE, &pos);
-    if (written < 0 || written != VBLOCK_SIZE) {
-        if (written < 0)
-            ret = (int)written;
-        else
-            ret = -EIO;
-    }
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
 
-    filp_close(filp, NULL);
-    kfree(tmp);
-    return ret;
+    if (req.flags)
+        return -EINVAL;
+
+    id = vblock_dev_create(req.size, req.region_size, NULL);
+    if (id < 0)
+        return id;
+
+    req.id = id;
+    return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
 }
-EXPORT_SYMBOL(vblock_backup_to_file);
 
-/* --- File operations table ----------------------------------------- */
+/* Unregister every device first, so no descriptor or disk is left to
+ * queue more work, then free them once the backup jobs are done
+ */
+static void vblock_devs_destroy(void)
+{
+    int i;
 
-static const struct file_operations vblock_fops = {
-    .owner          = THIS_MODULE,
-    .open           = vblock_open,
-    .release        = vblock_release,
-    .read           = vblock_read,
-    .write          = vblock_write,
-    .unlocked_ioctl = vblock_ioctl,
-    .llseek         = vblock_llseek,
-};
+    for (i = vblock_nr_devs - 1; i >= 0; --i)
+        vblock_dev_unregister(vblock_devs[i]);
 
-/* --- Init / Exit --------------------------------------------------- */
+    /* All descriptors are closed, so remaining jobs are orphans that
+     * free themselves; wait for them.
+     */
+    flush_workqueue(vblock_backup_wq);
+
+    for (i = vblock_nr_devs - 1; i >= 0; --i) {
+        vblock_dev_free(vblock_devs[i]);
+        vblock_devs[i] = NULL;
+    }
+    vblock_nr_devs = 0;
+}
 
 static int __init vblock_init(void)
 {
-    int ret, i;
+    unsigned long size;
+    unsigned int region_size;
+    unsigned int i;
+    int ret;
 
-    ret = alloc_chrdev_region(&vblock_dev, 0, 1, DEVICE_NAME);
-    if (ret)
-        return ret;
+    if (!nr_devices || nr_devices > VBLOCK_MAX_DEVICES) {
+        pr_err("vblock: devices must be 1..%d\n", VBLOCK_MAX_DEVICES);
+        return -EINVAL;
+    }
 
-    cdev_init(&vblock_cdev, &vblock_fops);
-    vblock_cdev.owner = THIS_MODULE;
+    vblock_backup_wq = alloc_workqueue("vblock_backup", WQ_UNBOUND, 0);
+    if (!vblock_backup_wq)
+        return -ENOMEM;
 
-    ret = cdev_add(&vblock_cdev, vblock_dev, 1);
+    ret = alloc_chrdev_region(&vblock_devt, 0, VBLOCK_MAX_DEVICES,
+                              DEVICE_NAME);
     if (ret)
-        goto err_unregister;
+        goto err_wq;
 
     vblock_class = class_create( CLASS_NAME);
     if (IS_ERR(vblock_class)) {
         ret = PTR_ERR(vblock_class);
-        goto err_cdev;
+        goto err_unregister;
     }
 
-    if (!device_create(vblock_class, NULL, vblock_dev, NULL,
-                       DEVICE_NAME "0")) {
-        ret = -ENOMEM;
+    vblk_major = register_blkdev(0, BLK_NAME);
+    if (vblk_major < 0) {
+        ret = vblk_major;
         goto err_class;
     }
 
-    memset(vblock_data, 0, sizeof(vblock_data));
-    memset(vblock_mirror, 0, sizeof(vblock_mirror));
-    region_lock_bitmap = 0;
+    vblock_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
 
-    for (i = 0; i < VBLOCK_NUM_REGIONS; ++i)
-        mutex_init(&region_mutex[i]);
-
-    sema_init(&vblock_read_sem, 1);
+    for (i = 0; i < nr_devices; ++i) {
+        vblock_param_geometry(i, &size, &region_size);
+        ret = vblock_dev_create(size, region_size,
+                                i < nr_restore_image ? restore_image[i]
+                                                     : NULL);
+        if (ret < 0)
+            goto err_devs;
+    }
 
-    pr_info("vblock: loaded (major=%d minor=%d), keys=%d, mirror=%d\n",
-            MAJOR(vblock_dev), MINOR(vblock_dev),
-            key_count, mirror_enable);
+    pr_info("vblock: loaded (major=%d, blk major=%d), devices=%u, mirror=%d\n",
+            MAJOR(vblock_devt), vblk_major, nr_devices, mirror_enable);
 
     return 0;
 
+err_devs:
+    vblock_devs_destroy();
+    debugfs_remove_recursive(vblock_debugfs);
+    unregister_blkdev(vblk_major, BLK_NAME);
 err_class:
     class_destroy(vblock_class);
-err_cdev:
-    cdev_del(&vblock_cdev);
 err_unregister:
-    unregister_chrdev_region(vblock_dev, 1);
+    unregister_chrdev_region(vblock_devt, VBLOCK_MAX_DEVICES);
+err_wq:
+    destroy_workqueue(vblock_backup_wq);
     return ret;
 }
 
 static void __exit vblock_exit(void)
 {
-    device_destroy(vblock_class, vblock_dev);
+    vblock_devs_destroy();
+    debugfs_remove_recursive(vblock_debugfs);
+    unregister_blkdev(vblk_major, BLK_NAME);
+
     class_destroy(vblock_class);
-    cdev_del(&vblock_cdev);
-    unregister_chrdev_region(vblock_dev, 1);
+    unregister_chrdev_region(vblock_devt, VBLOCK_MAX_DEVICES);
+
+    destroy_workqueue(vblock_backup_wq);
 
     pr_info("vblock: unloaded\n");
 }
@@ -579,6 +5373,5 @@ module_exit(vblock_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("You");
-MODULE_DESCRIPTION("Simulated 4KB virtual block device with region locks, keys, IOCTLs, and backup");
-MODULE_VERSION("1.0");
-
+MODULE_DESCRIPTION("Sparse virtual block device with region locks, keys, IOCTLs, and backup");
+MODULE_VERSION("1.1");
@@ -0,0 +1,713 @@
+/* vblock_bench.c
+ *
+ * Non-interactive load generator for /dev/vblock0, or the device -D
+ * names.
+ *
+ * -t threads run a weighted mix of operations for -d seconds:
+ *   pread   pread() of -s bytes at the start of a region (binary mode)
+ *   pwrite  pwrite() of -s bytes at the start of a region (binary mode)
+ *   region  VBLOCK_READ_REGION_BUF of min(-s, region_size) bytes
+ *   read    VBLOCK_READ_REGION of a whole region (512-byte regions only)
+ *   lock    VBLOCK_LOCK_REGION + VBLOCK_UNLOCK_REGION of a region
+ *   backup  VBLOCK_BACKUP_EX full backup to -b path
+ * Regions are picked uniformly, or with -z theta from a Zipf
+ * distribution where region 0 is the hottest. Lock ops make writes to
+ * the regions they hold fail with EACCES unless -k names a valid key;
+ * such failures are counted as errors of the write.
+ *
+ * One row per operation type with ops/s, MB/s, errors and p50/p99/p999
+ * and max latency (us) is printed as CSV (default) or JSON, tagged with
+ * -n label, or else the loaded driver's version, so runs against
+ * different driver versions can be compared.
+ *
+ * -C 0,1,2 repeats the run once per value of the driver's csum
+ * parameter (needs root), restoring it afterwards. Every row carries
+ * the csum level it ran at, and rows after the first run carry the
+ * checksum overhead: the drop in ops/s against the first run, in %.
+ *
+ * Usage: vblock_bench [-t threads] [-d seconds] [-s op_size]
+ *                     [-M op=weight,...] [-z theta] [-k key]
+ *                     [-b backup_path] [-P] [-f csv|json] [-H] [-n label]
+ *                     [-C csum,...] [-D device]
+ *   -P fills the device once before the run so reads hit real pages.
+ *   -H leaves out the CSV header, for appending to an existing file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include "vblock_ioctl.h"
+
+#define DEV_PATH "/dev/vblock0"
+#define VERSION_PATH "/sys/module/vblock/version"
+#define CSUM_PATH    "/sys/module/vblock/parameters/csum"
+#define MAX_RUNS     8
+
+enum { OP_PREAD, OP_PWRITE, OP_REGION, OP_READ, OP_LOCK, OP_BACKUP, OP_NR };
+
+static const char *op_names[OP_NR] = {
+    "pread", "pwrite", "region", "read", "lock", "backup"
+};
+
+/* Latency histogram: exact below 16 ns, then 16 linear sub-buckets per
+ * power of two (under 6.25% error).
+ */
+#define SUB_BITS   4
+#define NBUCKETS   (64 << SUB_BITS)
+
+struct op_stats {
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t max_ns;
+    uint64_t hist[NBUCKETS];
+};
+
+struct worker {
+    pthread_t tid;
+    uint64_t rng;
+    struct op_stats st[OP_NR];
+};
+
+static struct vblock_info info;
+static volatile int stop;
+
+static int nthreads = 4;
+static int seconds = 5;
+static size_t op_size;
+static double zipf_theta;
+static int use_key;
+static int key;
+static const char *dev_path = DEV_PATH;
+static const char *backup_path = "/tmp/vblock_bench.img";
+static const char *mix_arg = "pread=70,pwrite=30";
+static unsigned int weights[OP_NR];
+static unsigned int weight_total;
+static double *zipf_cdf;
+static const char *csum_arg;
+
+static int hist_index(uint64_t v)
+{
+    int msb;
+
+    if (v < (1 << SUB_BITS))
+        return v;
+
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - SUB_BITS + 1) << SUB_BITS) +
+           ((v >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+/* Midpoint of a bucket */
+static uint64_t hist_value(int idx)
+{
+    int shift;
+
+    if (idx < (1 << SUB_BITS))
+        return idx;
+
+    shift = (idx >> SUB_BITS) - 1;
+    return ((uint64_t)((1 << SUB_BITS) + (idx & ((1 << SUB_BITS) - 1))) << shift) +
+           ((1ULL << shift) >> 1);
+}
+
+static uint64_t percentile(const struct op_stats *st, double p)
+{
+    uint64_t want = (uint64_t)ceil(st->ops * p);
+    uint64_t seen = 0;
+    int i;
+
+    if (!st->ops)
+        return 0;
+    if (!want)
+        want = 1;
+
+    for (i = 0; i < NBUCKETS; ++i) {
+        seen += st->hist[i];
+        if (seen >= want)
+            return hist_value(i);
+    }
+    return st->max_ns;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static double rnd_unit(uint64_t *s)
+{
+    return (rnd(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int zipf_init(void)
+{
+    double sum = 0;
+    unsigned int i;
+
+    zipf_cdf = malloc(info.num_regions * sizeof(*zipf_cdf));
+    if (!zipf_cdf)
+        return -1;
+
+    for (i = 0; i < info.num_regions; ++i) {
+        sum += 1.0 / pow(i + 1, zipf_theta);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < info.num_regions; ++i)
+        zipf_cdf[i] /= sum;
+    return 0;
+}
+
+static unsigned int pick_region(uint64_t *s)
+{
+    unsigned int lo = 0, hi = info.num_regions - 1;
+    double u;
+
+    if (!zipf_cdf)
+        return rnd(s) % info.num_regions;
+
+    u = rnd_unit(s);
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int pick_op(uint64_t *s)
+{
+    unsigned int r = rnd(s) % weight_total;
+    int op;
+
+    for (op = 0; op < OP_NR; ++op) {
+        if (r < weights[op])
+            return op;
+        r -= weights[op];
+    }
+    return OP_PREAD;
+}
+
+static int parse_mix(const char *arg)
+{
+    char *copy = strdup(arg), *tok, *save;
+    int op;
+
+    if (!copy)
+        return -1;
+
+    for (tok = strtok_r(copy, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+
+        if (!eq)
+            goto bad;
+        *eq = '\0';
+        for (op = 0; op < OP_NR; ++op)
+            if (!strcmp(tok, op_names[op]))
+                break;
+        if (op == OP_NR)
+            goto bad;
+        weights[op] = atoi(eq + 1);
+        weight_total += weights[op];
+    }
+
+    free(copy);
+    return weight_total ? 0 : -1;
+bad:
+    fprintf(stderr, "bad mix entry '%s'\n", tok);
+    free(copy);
+    return -1;
+}
+
+static int open_dev(void)
+{
+    struct vblock_mode mode = { .mode = VBLOCK_MODE_BINARY };
+    int fd = open(dev_path, O_RDWR);
+
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    if (use_key) {
+        mode.flags = VBLOCK_MODE_F_KEY;
+        mode.key = key;
+    }
+    if (ioctl(fd, VBLOCK_SET_MODE, &mode) < 0) {
+        perror("SET_MODE ioctl");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Run one operation; returns bytes moved or -1 */
+static ssize_t do_op(int fd, int op, unsigned int region, char *buf)
+{
+    off_t pos = (off_t)region * info.region_size;
+    size_t len = op_size;
+    struct vblock_region_buf rb;
+    struct vblock_region rr;
+    struct vblock_backup_req req;
+    int r = region;
+
+    if (pos + len > info.size)
+        len = info.size - pos;
+
+    switch (op) {
+    case OP_PREAD:
+        return pread(fd, buf, len, pos);
+
+    case OP_PWRITE:
+        return pwrite(fd, buf, len, pos);
+
+    case OP_REGION:
+        memset(&rb, 0, sizeof(rb));
+        rb.region_index = region;
+        rb.len = len < info.region_size ? len : info.region_size;
+        rb.data = (unsigned long)buf;
+        if (ioctl(fd, VBLOCK_READ_REGION_BUF, &rb) < 0)
+            return -1;
+        return rb.len;
+
+    case OP_READ:
+        rr.region_index = region;
+        if (ioctl(fd, VBLOCK_READ_REGION, &rr) < 0)
+            return -1;
+        return sizeof(rr.data);
+
+    case OP_LOCK:
+        if (ioctl(fd, VBLOCK_LOCK_REGION, &r) < 0)
+            return -1;
+        if (ioctl(fd, VBLOCK_UNLOCK_REGION, &r) < 0)
+            return -1;
+        return 0;
+
+    case OP_BACKUP:
+        memset(&req, 0, sizeof(req));
+        snprintf(req.path, sizeof(req.path), "%s", backup_path);
+        req.eventfd = -1;
+        if (ioctl(fd, VBLOCK_BACKUP_EX, &req) < 0)
+            return -1;
+        return info.size;
+    }
+    return -1;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    char *buf = malloc(op_size > info.region_size ? op_size : info.region_size);
+    int fd = open_dev();
+
+    if (!buf || fd < 0)
+        goto out;
+    memset(buf, 'b', op_size);
+
+    while (!stop) {
+        int op = pick_op(&w->rng);
+        unsigned int region = pick_region(&w->rng);
+        struct op_stats *st = &w->st[op];
+        uint64_t t0 = now_ns(), dt;
+        ssize_t n = do_op(fd, op, region, buf);
+
+        dt = now_ns() - t0;
+        st->ops++;
+        st->hist[hist_index(dt)]++;
+        if (dt > st->max_ns)
+            st->max_ns = dt;
+        if (n < 0)
+            st->errors++;
+        else
+            st->bytes += n;
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int prefill(void)
+{
+    size_t chunk = 1 << 20;
+    char *buf = malloc(chunk);
+    uint64_t pos;
+    int fd = open_dev();
+
+    if (!buf || fd < 0)
+        goto fail;
+    memset(buf, 'p', chunk);
+
+    for (pos = 0; pos < info.size; pos += chunk) {
+        size_t n = info.size - pos < chunk ? info.size - pos : chunk;
+
+        if (pwrite(fd, buf, n, pos) != (ssize_t)n) {
+            perror("prefill pwrite");
+            goto fail;
+        }
+    }
+
+    close(fd);
+    free(buf);
+    return 0;
+fail:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return -1;
+}
+
+static void driver_version(char *out, size_t len)
+{
+    FILE *f = fopen(VERSION_PATH, "r");
+
+    snprintf(out, len, "unknown");
+    if (!f)
+        return;
+    if (fgets(out, len, f))
+        out[strcspn(out, "\n")] = '\0';
+    fclose(f);
+}
+
+/* The driver's csum parameter, or -1 if it has none */
+static int csum_get(void)
+{
+    FILE *f = fopen(CSUM_PATH, "r");
+    int level = -1;
+
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &level) != 1)
+        level = -1;
+    fclose(f);
+    return level;
+}
+
+static int csum_set(int level)
+{
+    FILE *f = fopen(CSUM_PATH, "w");
+
+    if (!f || fprintf(f, "%d\n", level) < 0 || fclose(f)) {
+        perror(CSUM_PATH);
+        return -1;
+    }
+    return 0;
+}
+
+/* Drop in ops/s against @base, in %; 0 without a base */
+static double overhead(const struct op_stats *st, double elapsed,
+                       const double *base, int op)
+{
+    double rate = st[op].ops / elapsed;
+
+    if (!base || !base[op])
+        return 0;
+    return (base[op] - rate) / base[op] * 100;
+}
+
+static void print_csv(const struct op_stats *st, const char *label,
+                      double elapsed, int header, int csum,
+                      const double *base)
+{
+    int op;
+
+    if (header)
+        printf("label,op,threads,op_size,zipf,mix,csum,seconds,ops,ops_per_sec,"
+               "mb_per_sec,errors,p50_us,p99_us,p999_us,max_us,"
+               "csum_overhead_pct\n");
+
+    for (op = 0; op < OP_NR; ++op) {
+        if (!weights[op])
+            continue;
+        printf("%s,%s,%d,%zu,%.2f,\"%s\",%d,%.3f,%llu,%.0f,%.2f,%llu,%.2f,%.2f,%.2f,%.2f,%.1f\n",
+               label, op_names[op], nthreads, op_size, zipf_theta, mix_arg,
+               csum, elapsed, (unsigned long long)st[op].ops,
+               st[op].ops / elapsed, st[op].bytes / elapsed / 1e6,
+               (unsigned long long)st[op].errors,
+               percentile(&st[op], 0.50) / 1e3,
+               percentile(&st[op], 0.99) / 1e3,
+               percentile(&st[op], 0.999) / 1e3,
+               st[op].max_ns / 1e3, overhead(st, elapsed, base, op));
+    }
+}
+
+/* Print @s as a JSON string, quotes included */
+static void json_str(const char *s)
+{
+    putchar('"');
+    for (; *s; ++s) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void print_json(const struct op_stats *st, const char *label,
+                       double elapsed, int csum, const double *base)
+{
+    int op, first = 1;
+
+    printf("{\"label\": ");
+    json_str(label);
+    printf(", \"threads\": %d, \"op_size\": %zu, \"zipf\": %.2f, \"mix\": ",
+           nthreads, op_size, zipf_theta);
+    json_str(mix_arg);
+    printf(", \"csum\": %d, \"seconds\": %.3f, \"size\": %llu, "
+           "\"region_size\": %u, \"results\": [",
+           csum, elapsed, (unsigned long long)info.size, info.region_size);
+
+    for (op = 0; op < OP_NR; ++op) {
+        if (!weights[op])
+            continue;
+        printf("%s\n  {\"op\": \"%s\", \"ops\": %llu, \"ops_per_sec\": %.0f, "
+               "\"mb_per_sec\": %.2f, \"errors\": %llu, \"p50_us\": %.2f, "
+               "\"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f, "
+               "\"csum_overhead_pct\": %.1f}",
+               first ? "" : ",", op_names[op],
+               (unsigned long long)st[op].ops, st[op].ops / elapsed,
+               st[op].bytes / elapsed / 1e6,
+               (unsigned long long)st[op].errors,
+               percentile(&st[op], 0.50) / 1e3,
+               percentile(&st[op], 0.99) / 1e3,
+               percentile(&st[op], 0.999) / 1e3,
+               st[op].max_ns / 1e3, overhead(st, elapsed, base, op));
+        first = 0;
+    }
+    printf("\n]}\n");
+}
+
+/* One timed run of the mix; returns its length in seconds */
+static double run(struct op_stats *total)
+{
+    struct worker *w;
+    uint64_t t0;
+    int i, op, b;
+
+    w = calloc(nthreads, sizeof(*w));
+    if (!w) {
+        perror("calloc");
+        return -1;
+    }
+
+    stop = 0;
+    t0 = now_ns();
+    for (i = 0; i < nthreads; ++i) {
+        w[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ t0;
+        pthread_create(&w[i].tid, NULL, worker_fn, &w[i]);
+    }
+
+    sleep(seconds);
+    stop = 1;
+
+    memset(total, 0, OP_NR * sizeof(*total));
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(w[i].tid, NULL);
+        for (op = 0; op < OP_NR; ++op) {
+            struct op_stats *s = &w[i].st[op];
+
+            total[op].ops += s->ops;
+            total[op].errors += s->errors;
+            total[op].bytes += s->bytes;
+            if (s->max_ns > total[op].max_ns)
+                total[op].max_ns = s->max_ns;
+            for (b = 0; b < NBUCKETS; ++b)
+                total[op].hist[b] += s->hist[b];
+        }
+    }
+
+    free(w);
+    return (now_ns() - t0) / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-d seconds] [-s op_size]\n"
+            "          [-M op=weight,...] [-z theta] [-k key]\n"
+            "          [-b backup_path] [-P] [-f csv|json] [-H] [-n label]\n"
+            "          [-C csum,...] [-D device]\n"
+            "ops: pread pwrite region read lock backup\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct op_stats total[OP_NR];
+    const char *format = "csv";
+    char label[64] = "";
+    int header = 1, fill = 0;
+    int levels[MAX_RUNS];
+    int nruns = 1, saved, ret = 0;
+    double base[OP_NR];
+    double elapsed;
+    int fd, opt, i, op;
+
+    while ((opt = getopt(argc, argv, "t:d:s:M:z:k:b:Pf:Hn:C:D:")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            op_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'M':
+            mix_arg = optarg;
+            break;
+        case 'z':
+            zipf_theta = atof(optarg);
+            break;
+        case 'k':
+            use_key = 1;
+            key = atoi(optarg);
+            break;
+        case 'b':
+            backup_path = optarg;
+            break;
+        case 'P':
+            fill = 1;
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'H':
+            header = 0;
+            break;
+        case 'n':
+            snprintf(label, sizeof(label), "%s", optarg);
+            break;
+        case 'C':
+            csum_arg = optarg;
+            break;
+        case 'D':
+            dev_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (nthreads < 1 || seconds < 1 ||
+        (strcmp(format, "csv") && strcmp(format, "json")) ||
+        parse_mix(mix_arg)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    saved = csum_get();
+    levels[0] = saved;
+    if (csum_arg) {
+        const char *p = csum_arg;
+        char *end;
+
+        for (nruns = 0; ; p = end + 1) {
+            levels[nruns++] = strtol(p, &end, 0);
+            if (end == p || levels[nruns - 1] < 0 ||
+                (*end && (*end != ',' || nruns == MAX_RUNS))) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (!*end)
+                break;
+        }
+        if (saved < 0) {
+            fprintf(stderr, "loaded driver has no csum parameter\n");
+            return 1;
+        }
+    }
+
+    fd = open(dev_path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    if (ioctl(fd, VBLOCK_GET_INFO, &info) < 0) {
+        perror("GET_INFO ioctl");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    if (weights[OP_READ] && info.region_size != VBLOCK_REGION_SIZE) {
+        fprintf(stderr, "read needs %d-byte regions, device has %u\n",
+                VBLOCK_REGION_SIZE, info.region_size);
+        return 1;
+    }
+    if (!op_size)
+        op_size = info.region_size;
+    if (op_size > info.size) {
+        fprintf(stderr, "op size %zu exceeds device size %llu\n",
+                op_size, (unsigned long long)info.size);
+        return 1;
+    }
+    if (zipf_theta > 0 && zipf_init()) {
+        perror("zipf");
+        return 1;
+    }
+    if (!label[0])
+        driver_version(label, sizeof(label));
+    if (fill && prefill())
+        return 1;
+
+    for (i = 0; i < nruns; ++i) {
+        if (csum_arg && csum_set(levels[i])) {
+            ret = 1;
+            break;
+        }
+
+        elapsed = run(total);
+        if (elapsed < 0) {
+            ret = 1;
+            break;
+        }
+
+        if (!strcmp(format, "json"))
+            print_json(total, label, elapsed, levels[i], i ? base : NULL);
+        else
+            print_csv(total, label, elapsed, header && !i, levels[i],
+                      i ? base : NULL);
+
+        if (!i)
+            for (op = 0; op < OP_NR; ++op)
+                base[op] = total[op].ops / elapsed;
+    }
+
+    if (csum_arg)
+        csum_set(saved);
+    free(zipf_cdf);
+    return ret;
+}
@@ -6,10 +6,20 @@
 #include <linux/ioctl.h>
 #include <linux/types.h>
 
+/* Default geometry. The live values come from the size= and region_size=
+ * module parameters (one entry per device) or VBLOCK_DEV_ADD, and are
+ * reported by VBLOCK_GET_INFO.
+ */
 #define VBLOCK_SIZE         4096
 #define VBLOCK_REGION_SIZE  512
 #define VBLOCK_NUM_REGIONS  (VBLOCK_SIZE / VBLOCK_REGION_SIZE)
 
+/* Upper bound on regions (size / region_size) */
+#define VBLOCK_MAX_REGIONS  65536
+
+/* Upper bound on devices, /dev/vblock0 .. /dev/vblock63 */
+#define VBLOCK_MAX_DEVICES  64
+
 /* IOCTL magic */
 #define VBLOCK_IOC_MAGIC    'v'
 
@@ -21,6 +31,8 @@
 #define VBLOCK_READ_MIRROR   _IOW('v', 21, struct vblock_region)
 /* Read full 512 B region:
  * user passes .region_index; kernel fills .data[].
+ * Only valid while region_size is the default VBLOCK_REGION_SIZE;
+ * use VBLOCK_READ_REGION_BUF for other geometries.
  */
 struct vblock_region {
     __u32 region_index;
@@ -31,16 +43,457 @@ struct vblock_region {
 
 /* Get info bitmap & geometry */
 struct vblock_info {
-    __u32 size;          /* total size bytes */
-    __u32 region_size;   /* region size bytes (512) */
-    __u32 num_regions;   /* 8 */
-    __u8  lock_bitmap;   /* bit i = 1 => region i locked */
+    __u64 size;           /* total size bytes */
+    __u32 region_size;    /* region size bytes */
+    __u32 num_regions;    /* size / region_size */
+    __u64 resident_pages; /* backing pages allocated for data */
+    __u64 mirror_pages;   /* backing pages allocated for the mirror */
+    __u32 page_size;      /* size of one backing page */
+    __u8  lock_bitmap;    /* bit i = 1 => region i locked, regions 0-7;
+                           * VBLOCK_GET_LOCK_BITMAP covers them all */
 };
 
 #define VBLOCK_GET_INFO      _IOR(VBLOCK_IOC_MAGIC, 4, struct vblock_info)
 
-/* Erase (zero) a region: arg = int region_index */
+/* The original layout with a 32-bit size. Its ioctl number differs from
+ * VBLOCK_GET_INFO's, so binaries built against it keep working; it
+ * fails with EOVERFLOW on a device of 4 GiB or more.
+ */
+struct vblock_info_v1 {
+    __u32 size;
+    __u32 region_size;
+    __u32 num_regions;
+    __u8  lock_bitmap;
+};
+
+#define VBLOCK_GET_INFO_V1   _IOR(VBLOCK_IOC_MAGIC, 4, struct vblock_info_v1)
+
+/* Erase (zero) a region: arg = int region_index. O(1): the region
+ * reads as zeros at once and its memory is freed in the background.
+ */
 #define VBLOCK_ERASE_REGION  _IOW(VBLOCK_IOC_MAGIC, 5, int)
 
-#endif /* _VBLOCK_IOCTL_H_ */
+/* Read part of a region of any size into a user buffer:
+ * user passes .region_index, .offset (inside the region), .len and
+ * .data (user pointer); kernel copies and sets .len to bytes copied.
+ */
+struct vblock_region_buf {
+    __u32 region_index;
+    __u32 flags;          /* VBLOCK_RB_* */
+    __u64 offset;
+    __u64 len;
+    __u64 data;
+};
+
+#define VBLOCK_RB_MIRROR      (1U << 0)   /* read the mirror copy */
+#define VBLOCK_RB_SNAPSHOT    (1U << 1)   /* read the snapshot (-ENOENT if none) */
+
+#define VBLOCK_READ_REGION_BUF _IOWR(VBLOCK_IOC_MAGIC, 6, struct vblock_region_buf)
+
+/* Select how write() interprets data on this file descriptor:
+ *   VBLOCK_MODE_ASCII  - "<key>:<offset>:<data>" / "<offset>:<data>"
+ *   VBLOCK_MODE_BINARY - raw bytes written at the file position
+ *                        (write/pwrite/writev), may span regions.
+ *                        A spanning write is atomic up to 1 MiB; a
+ *                        longer one returns a short count there.
+ * With VBLOCK_MODE_F_KEY this also starts a session for .key as
+ * VBLOCK_AUTH does; without it, it ends any session.
+ */
+struct vblock_mode {
+    __u32 mode;           /* VBLOCK_MODE_* */
+    __u32 flags;          /* VBLOCK_MODE_F_* */
+    __s32 key;
+};
+
+#define VBLOCK_MODE_ASCII     0
+#define VBLOCK_MODE_BINARY    1
+
+#define VBLOCK_MODE_F_KEY     (1U << 0)
+
+#define VBLOCK_SET_MODE      _IOW(VBLOCK_IOC_MAGIC, 7, struct vblock_mode)
+
+/* Read many regions in one call.
+ * .mask points to a bitmap of __u64 words (bit i = region i) covering
+ * .mask_bits regions. Requested regions are copied in index order into
+ * consecutive region_size slots of .buf, which must hold them all.
+ * .gens points to one __u64 per requested region, in the same order:
+ *   VBLOCK_BATCH_GENS      - kernel stores each region's generation
+ *   VBLOCK_BATCH_SKIP_SAME - caller stores the generations it last saw;
+ *                            unchanged regions are skipped (slot left
+ *                            untouched) and their mask bit is cleared.
+ * On return the mask holds the regions actually copied.
+ */
+struct vblock_batch_read {
+    __u64 mask;
+    __u32 mask_bits;
+    __u32 flags;          /* VBLOCK_BATCH_* */
+    __u64 buf;
+    __u64 buf_len;
+    __u64 gens;
+    __u32 nr_copied;      /* out */
+    __u32 nr_skipped;     /* out */
+};
+
+#define VBLOCK_BATCH_GENS       (1U << 0)
+#define VBLOCK_BATCH_SKIP_SAME  (1U << 1)
+
+#define VBLOCK_READ_BATCH    _IOWR(VBLOCK_IOC_MAGIC, 8, struct vblock_batch_read)
+
+/* Asynchronous backup.
+ * VBLOCK_BACKUP_ASYNC queues a backup of the device to .path and returns
+ * at once with .job_id set. If .eventfd >= 0 it is signalled when the
+ * job finishes. poll() on the same descriptor reports EPOLLPRI while a
+ * finished job has not been reaped.
+ */
+struct vblock_backup_req {
+    char  path[256];
+    __s32 eventfd;        /* -1 for none (ignored by VBLOCK_BACKUP_EX) */
+    __u32 flags;          /* VBLOCK_BACKUP_F_* */
+    __u32 job_id;         /* out */
+};
+
+#define VBLOCK_BACKUP_F_INCREMENTAL (1U << 0)  /* delta since last backup */
+#define VBLOCK_BACKUP_F_SNAPSHOT    (1U << 1)  /* full image of the snapshot */
+#define VBLOCK_BACKUP_F_IMAGE       (1U << 2)  /* full image with a header */
+
+#define VBLOCK_BACKUP_ASYNC  _IOWR(VBLOCK_IOC_MAGIC, 9, struct vblock_backup_req)
+
+/* Query a job queued on this descriptor. With VBLOCK_JOB_F_REAP a
+ * finished job is released and its id becomes invalid.
+ */
+struct vblock_backup_status {
+    __u32 job_id;
+    __u32 flags;          /* VBLOCK_JOB_F_* */
+    __u32 state;          /* out: VBLOCK_JOB_* */
+    __s32 error;          /* out: 0 or negative errno once done */
+    __u64 bytes;          /* out: bytes written so far */
+    __u64 elapsed_ns;     /* out: run time so far, or total once done */
+};
+
+#define VBLOCK_JOB_QUEUED     0
+#define VBLOCK_JOB_RUNNING    1
+#define VBLOCK_JOB_DONE       2
+
+#define VBLOCK_JOB_F_REAP     (1U << 0)
+
+#define VBLOCK_BACKUP_STATUS _IOWR(VBLOCK_IOC_MAGIC, 10, struct vblock_backup_status)
+
+/* Synchronous backup with flags; .eventfd and .job_id are unused */
+#define VBLOCK_BACKUP_EX     _IOWR(VBLOCK_IOC_MAGIC, 11, struct vblock_backup_req)
+
+/* Incremental backup file (VBLOCK_BACKUP_F_INCREMENTAL):
+ *   struct vblock_delta_hdr
+ *   __u32 region index[count]
+ *   count payloads of region_size bytes, in index order
+ * A delta holds the regions written since the previous backup, full or
+ * incremental; .seq counts successful backups so a chain of deltas can
+ * be checked for gaps. Apply on top of a full image with vblock_merge.
+ */
+#define VBLOCK_DELTA_MAGIC    "VBLKDLT1"
+#define VBLOCK_DELTA_VERSION  1
+
+struct vblock_delta_hdr {
+    __u8  magic[8];
+    __u32 version;
+    __u32 region_size;
+    __u64 size;
+    __u32 num_regions;
+    __u32 count;
+    __u64 seq;
+};
+
+/* Point-in-time snapshot.
+ * VBLOCK_SNAPSHOT_CREATE freezes the current contents of the device
+ * without copying them and returns the snapshot id; each region is
+ * copied aside on its first change after that. Only one snapshot exists
+ * at a time (-EBUSY); VBLOCK_SNAPSHOT_DROP releases it. Read it with
+ * VBLOCK_RB_SNAPSHOT or back it up with VBLOCK_BACKUP_F_SNAPSHOT.
+ */
+#define VBLOCK_SNAPSHOT_CREATE _IOR(VBLOCK_IOC_MAGIC, 12, __u64)
+#define VBLOCK_SNAPSHOT_DROP   _IO(VBLOCK_IOC_MAGIC, 13)
+
+/* Mirror lag. With the mirror_async module parameter, writes reach the
+ * mirror from a worker; VBLOCK_MIRROR_STAT reports how far behind it
+ * is and VBLOCK_MIRROR_FLUSH returns once every write made before the
+ * call is mirrored (-EOPNOTSUPP if mirroring is off).
+ */
+struct vblock_mirror_stat {
+    __u32 async;            /* mirror_async in effect */
+    __u32 regions_pending;  /* regions whose mirror is behind */
+    __u64 bytes_pending;    /* bytes written but not yet mirrored */
+    __u64 oldest_ns;        /* age of the oldest unmirrored change */
+    __u64 batches;          /* worker passes that copied something */
+    __u64 regions_synced;   /* region copies made by worker or flush */
+};
+
+#define VBLOCK_MIRROR_STAT   _IOR(VBLOCK_IOC_MAGIC, 14, struct vblock_mirror_stat)
+#define VBLOCK_MIRROR_FLUSH  _IO(VBLOCK_IOC_MAGIC, 15)
+
+/* Lock bitmap in pages: user passes .first (a multiple of 64), .nr
+ * regions wanted and .bits, room for DIV_ROUND_UP(nr, 64) __u64 words
+ * (bit i of word w = region first + 64 * w + i). The kernel clamps .nr
+ * to the device and to VBLOCK_LOCKMAP_MAX_BITS and returns it.
+ */
+#define VBLOCK_LOCKMAP_MAX_BITS  32768     /* one 4 KiB page of words */
+
+struct vblock_lock_bitmap {
+    __u32 first;
+    __u32 nr;
+    __u64 bits;
+};
+
+#define VBLOCK_GET_LOCK_BITMAP _IOWR(VBLOCK_IOC_MAGIC, 16, struct vblock_lock_bitmap)
+
+/* Lock owner and generations of one region: user passes .region_index */
+struct vblock_region_info {
+    __u32 region_index;
+    __u32 locked;
+    __s32 owner_pid;      /* process that last locked it */
+    __u32 owner_uid;
+    __u64 lock_time_ns;   /* CLOCK_REALTIME of the last lock */
+    __u64 lock_gen;       /* lock and unlock transitions so far */
+    __u64 gen;            /* data generation (see VBLOCK_READ_BATCH) */
+};
+
+#define VBLOCK_GET_REGION_INFO _IOWR(VBLOCK_IOC_MAGIC, 17, struct vblock_region_info)
+
+/* Runtime keys (CAP_SYS_ADMIN). VBLOCK_KEY_ADD adds .key, or rebinds
+ * it if present. With VBLOCK_KEY_F_REGIONS the key only opens the
+ * regions set in the bitmap at .mask (__u64 words, .mask_bits regions);
+ * otherwise it opens every locked region. VBLOCK_KEY_REVOKE takes an
+ * int key and removes it; writes already in progress finish.
+ */
+#define VBLOCK_MAX_KEYS       65536
 
+struct vblock_key_req {
+    __s32 key;
+    __u32 flags;          /* VBLOCK_KEY_F_* */
+    __u32 mask_bits;
+    __u32 reserved;
+    __u64 mask;
+};
+
+#define VBLOCK_KEY_F_REGIONS  (1U << 0)
+
+#define VBLOCK_KEY_ADD       _IOW(VBLOCK_IOC_MAGIC, 18, struct vblock_key_req)
+#define VBLOCK_KEY_REVOKE    _IOW(VBLOCK_IOC_MAGIC, 19, int)
+
+/* Compressed storage (compress=1 module parameter). Cold regions are
+ * kept LZ4-compressed and thawed on access; hot_regions of them stay
+ * decompressed. Ratio = raw_bytes / compressed_bytes; hit rate =
+ * 1 - thaws / accesses.
+ */
+struct vblock_compress_stat {
+    __u32 enabled;
+    __u32 hot_limit;        /* hot_regions parameter */
+    __u32 hot_regions;      /* regions resident and on the LRU */
+    __u32 cold_regions;     /* regions held compressed */
+    __u64 raw_bytes;        /* uncompressed size of the cold regions */
+    __u64 compressed_bytes; /* memory their compressed copies use */
+    __u64 accesses;         /* region accesses seen by the LRU */
+    __u64 thaws;            /* accesses that had to decompress */
+    __u64 freezes;          /* regions compressed */
+    __u64 rejects;          /* regions that didn't compress well enough */
+};
+
+#define VBLOCK_COMPRESS_STAT _IOR(VBLOCK_IOC_MAGIC, 22, struct vblock_compress_stat)
+
+/* Discard a byte range: it reads as zeros afterwards and its backing
+ * pages are freed (zeroed in place while the device is mmapped). Whole
+ * regions inside it are erased as by VBLOCK_ERASE_REGION. Locked
+ * regions need a session (VBLOCK_AUTH) whose key opens them; on -EACCES
+ * the regions before the locked one have been discarded. .flags must
+ * be 0.
+ */
+struct vblock_discard {
+    __u64 offset;
+    __u64 len;
+    __u32 flags;
+    __u32 reserved;
+};
+
+#define VBLOCK_DISCARD       _IOW(VBLOCK_IOC_MAGIC, 23, struct vblock_discard)
+
+/* Statistics. Per-region counters since load; erases also count
+ * partial discards, lock_fails are writes to a locked region without a
+ * key and refused VBLOCK_LOCK_REGION calls, key_fails are writes whose
+ * key doesn't open the region.
+ */
+struct vblock_region_stats {
+    __u64 reads;
+    __u64 read_bytes;
+    __u64 writes;
+    __u64 write_bytes;
+    __u64 erases;
+    __u64 lock_fails;
+    __u64 key_fails;
+    __u64 csum_errors;    /* data found not to match its CRC32C */
+    __u64 repairs;        /* of those, copied back from the mirror */
+};
+
+/* log2 latency histograms in ns: bucket 0 counts 0 ns, bucket b counts
+ * [2^(b-1), 2^b) and the last bucket everything above. Reads and writes
+ * are timed per region access (a spanning write once), backups per
+ * file, lock waits only when the region mutex was contended.
+ */
+#define VBLOCK_HIST_BUCKETS  32
+
+enum {
+    VBLOCK_LAT_READ,
+    VBLOCK_LAT_WRITE,
+    VBLOCK_LAT_BACKUP,
+    VBLOCK_LAT_LOCK_WAIT,
+    VBLOCK_LAT_NR,
+};
+
+struct vblock_latency {
+    __u64 hist[VBLOCK_LAT_NR][VBLOCK_HIST_BUCKETS];
+};
+
+/* Snapshot the counters of regions [.first, .first + .nr) into the
+ * array at .regions, and the histograms into .latency (either pointer
+ * may be 0). .nr is clipped to the regions that exist. The same data
+ * is in /sys/kernel/debug/vblock/vblockN/{regions,latency}.
+ */
+struct vblock_stats {
+    __u32 first;
+    __u32 nr;
+    __u64 regions;        /* struct vblock_region_stats[nr] */
+    __u64 latency;        /* struct vblock_latency */
+};
+
+#define VBLOCK_GET_STATS     _IOWR(VBLOCK_IOC_MAGIC, 24, struct vblock_stats)
+
+/* Full image with a header (VBLOCK_BACKUP_F_IMAGE, not with
+ * VBLOCK_BACKUP_F_INCREMENTAL):
+ *   struct vblock_image_hdr
+ *   __u64 lock bitmap words[(num_regions + 63) / 64], if .flags has
+ *         VBLOCK_IMAGE_F_LOCKS (bit i of word i / 64 is region i)
+ *   the raw image from .data_offset (page aligned) on
+ * Deltas apply to it as to a raw image, at .data_offset.
+ */
+#define VBLOCK_IMAGE_MAGIC    "VBLKIMG1"
+#define VBLOCK_IMAGE_VERSION  1
+
+#define VBLOCK_IMAGE_F_LOCKS  (1U << 0)
+
+struct vblock_image_hdr {
+    __u8  magic[8];
+    __u32 version;
+    __u32 region_size;
+    __u64 size;
+    __u32 num_regions;
+    __u32 flags;          /* VBLOCK_IMAGE_F_* */
+    __u64 data_offset;
+    __u64 seq;            /* backup sequence, as in vblock_delta_hdr */
+};
+
+/* Load a file into the device: an image with a header, a delta
+ * (regions not in it are left alone) or, with VBLOCK_RESTORE_F_RAW, a
+ * raw image exactly the device's size. The kind is taken from the
+ * file's magic, except that a raw image is never guessed: its first
+ * bytes could be anything. The geometry must match the device's. A delta must be the
+ * next in its chain: its .seq one past the device's backup sequence,
+ * which an image restore sets to the image's .seq and every applied
+ * delta advances; otherwise -EINVAL. With VBLOCK_RESTORE_F_LOCKS the
+ * region locks are set from the image's lock bitmap; regions mapped
+ * writable are left unlocked. Needs CAP_SYS_ADMIN. The restore= module
+ * parameter does the same at load.
+ */
+struct vblock_restore_req {
+    char  path[256];
+    __u32 flags;          /* VBLOCK_RESTORE_F_* */
+    __u32 restored;       /* out: regions written */
+};
+
+#define VBLOCK_RESTORE_F_LOCKS  (1U << 0)
+#define VBLOCK_RESTORE_F_RAW    (1U << 1)   /* the file is a raw image */
+
+#define VBLOCK_RESTORE       _IOWR(VBLOCK_IOC_MAGIC, 25, struct vblock_restore_req)
+
+/* Create another device, /dev/vblockN and /dev/vblkN with N returned
+ * in .id, as the devices= module parameter does at load. Zero .size or
+ * .region_size take what the size= and region_size= parameters give
+ * device N; the size must be a multiple of the 512-byte sector, as the
+ * device is also a disk. Every device has its own geometry, data, locks
+ * and keys; devices last until the module is unloaded. Needs
+ * CAP_SYS_ADMIN and works on a descriptor of any vblock device.
+ */
+struct vblock_dev_req {
+    __u64 size;
+    __u32 region_size;
+    __u32 flags;          /* must be 0 */
+    __u32 id;             /* out */
+    __u32 reserved;
+};
+
+#define VBLOCK_DEV_ADD       _IOWR(VBLOCK_IOC_MAGIC, 26, struct vblock_dev_req)
+
+/* Authenticate this descriptor once with .key (-EACCES if unknown).
+ * Writes and discards on it that carry no key of their own may then
+ * change the regions the key opens without a key lookup each time;
+ * .regions returns how many regions are writable, locked or not. The
+ * session follows key and lock changes: if its key is revoked it ends,
+ * and writes to locked regions fail until the next VBLOCK_AUTH.
+ * VBLOCK_AUTH_F_END ends the session; closing the descriptor does too.
+ */
+struct vblock_auth {
+    __s32 key;
+    __u32 flags;          /* VBLOCK_AUTH_F_* */
+    __u32 regions;        /* out */
+    __u32 reserved;
+};
+
+#define VBLOCK_AUTH_F_END     (1U << 0)
+
+#define VBLOCK_AUTH          _IOWR(VBLOCK_IOC_MAGIC, 27, struct vblock_auth)
+
+/* Change notification. VBLOCK_WATCH sets the regions this descriptor
+ * watches: the bitmap at .mask (__u64 words, .mask_bits regions, as for
+ * VBLOCK_KEY_ADD), or none if .mask_bits is 0. poll()/epoll then report
+ * EPOLLIN while a watched region has been written, erased, discarded,
+ * restored, locked or unlocked since the last complete
+ * VBLOCK_WATCH_CHANGES; changes before VBLOCK_WATCH are not reported,
+ * nor are stores through a shared mapping. Set the mask before adding
+ * the descriptor to an epoll set, which only waits for the regions
+ * watched at EPOLL_CTL_ADD.
+ */
+struct vblock_watch {
+    __u64 mask;
+    __u32 mask_bits;
+    __u32 flags;          /* must be 0 */
+};
+
+#define VBLOCK_WATCH         _IOW(VBLOCK_IOC_MAGIC, 28, struct vblock_watch)
+
+/* VBLOCK_WATCH_CHANGES fills .entries (up to .max) with the watched
+ * regions changed since the last complete call, in region order, and
+ * their current generations: compare with an earlier report to tell
+ * data changes (.gen) from lock changes (.lock_gen). With
+ * VBLOCK_CHANGES_F_MORE in .flags the array filled up; call again for
+ * the rest. A region changing during a call may be reported again by
+ * the next one. .seq is the device change count the report covers.
+ */
+#define VBLOCK_CHANGES_MAX    4096
+
+struct vblock_change {
+    __u32 region;
+    __u32 locked;
+    __u64 gen;
+    __u64 lock_gen;
+};
+
+struct vblock_changes {
+    __u64 entries;        /* struct vblock_change [max] */
+    __u32 max;
+    __u32 nr;             /* out */
+    __u32 flags;          /* out: VBLOCK_CHANGES_F_* */
+    __u32 reserved;
+    __u64 seq;            /* out */
+};
+
+#define VBLOCK_CHANGES_F_MORE (1U << 0)
+
+#define VBLOCK_WATCH_CHANGES _IOWR(VBLOCK_IOC_MAGIC, 29, struct vblock_changes)
+
+#endif /* _VBLOCK_IOCTL_H_ */
@@ -0,0 +1,239 @@
+/* vblock_merge.c
+ *
+ * Rebuild a device image from a full backup and a chain of incremental
+ * (VBLOCK_BACKUP_F_INCREMENTAL) deltas.
+ *
+ * Usage: vblock_merge [-r] <base> <out> <delta>...
+ *   Copies <base> to <out>, then applies each delta in order. Deltas
+ *   must match the base geometry and have consecutive sequence numbers.
+ *   The base is an image with a header (VBLOCK_BACKUP_F_IMAGE), or with
+ *   -r a raw image; a raw base is never guessed from its first bytes.
+ *   The output keeps the base's header, with its sequence number
+ *   advanced to the last delta's, so it can be loaded with
+ *   VBLOCK_RESTORE or restore= as it is and the next delta in the
+ *   chain applies on top of it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "vblock_ioctl.h"
+
+static int copy_file(const char *src, const char *dst, off_t *size)
+{
+    char buf[65536];
+    struct stat st;
+    ssize_t n;
+    int in, out;
+    int ret = -1;
+
+    in = open(src, O_RDONLY);
+    if (in < 0) {
+        perror(src);
+        return -1;
+    }
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror(dst);
+        close(in);
+        return -1;
+    }
+
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            perror(dst);
+            goto out;
+        }
+    }
+    if (n < 0) {
+        perror(src);
+        goto out;
+    }
+    if (fstat(in, &st) < 0) {
+        perror(src);
+        goto out;
+    }
+    *size = st.st_size;
+    ret = 0;
+out:
+    close(in);
+    close(out);
+    return ret;
+}
+
+/* A headered base: the image starts at its data offset, deltas must
+ * have its region size, and the first must follow its sequence number.
+ */
+static int image_header(int out, const char *path, off_t *size, off_t *base,
+                        uint32_t *region_size, uint64_t *seq)
+{
+    struct vblock_image_hdr hdr;
+
+    if (pread(out, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, VBLOCK_IMAGE_MAGIC, sizeof(hdr.magic))) {
+        fprintf(stderr, "%s: not a vblock image (-r for a raw one)\n", path);
+        return -1;
+    }
+
+    if (hdr.version != VBLOCK_IMAGE_VERSION || !hdr.region_size ||
+        (uint64_t)hdr.region_size * hdr.num_regions != hdr.size ||
+        hdr.data_offset > (uint64_t)*size ||
+        (uint64_t)*size - hdr.data_offset < hdr.size) {
+        fprintf(stderr, "%s: bad image header\n", path);
+        return -1;
+    }
+
+    *size = hdr.size;
+    *base = hdr.data_offset;
+    *region_size = hdr.region_size;
+    *seq = hdr.seq;
+    return 0;
+}
+
+/* @region_size is 0 for a raw base, which records none */
+static int apply_delta(int out, const char *path, off_t size, off_t base,
+                       uint32_t region_size, uint64_t *seq)
+{
+    struct vblock_delta_hdr hdr;
+    uint32_t *index = NULL;
+    char *buf = NULL;
+    int ret = -1;
+    uint32_t k;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, VBLOCK_DELTA_MAGIC, sizeof(hdr.magic))) {
+        fprintf(stderr, "%s: not a vblock delta\n", path);
+        goto out;
+    }
+    if (hdr.version != VBLOCK_DELTA_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u\n", path, hdr.version);
+        goto out;
+    }
+    if (hdr.size != (uint64_t)size || !hdr.region_size ||
+        (region_size && hdr.region_size != region_size) ||
+        (uint64_t)hdr.region_size * hdr.num_regions != hdr.size ||
+        hdr.count > hdr.num_regions) {
+        fprintf(stderr, "%s: geometry does not match the base image\n", path);
+        goto out;
+    }
+    if (*seq && hdr.seq != *seq + 1) {
+        fprintf(stderr, "%s: sequence %llu does not follow %llu\n", path,
+                (unsigned long long)hdr.seq, (unsigned long long)*seq);
+        goto out;
+    }
+
+    index = calloc(hdr.count ? hdr.count : 1, sizeof(*index));
+    buf = malloc(hdr.region_size);
+    if (!index || !buf) {
+        fprintf(stderr, "out of memory\n");
+        goto out;
+    }
+    if (read(fd, index, hdr.count * sizeof(*index)) !=
+        (ssize_t)(hdr.count * sizeof(*index))) {
+        fprintf(stderr, "%s: truncated index\n", path);
+        goto out;
+    }
+
+    for (k = 0; k < hdr.count; ++k) {
+        off_t pos = base + (off_t)index[k] * hdr.region_size;
+
+        if (index[k] >= hdr.num_regions) {
+            fprintf(stderr, "%s: bad region %u\n", path, index[k]);
+            goto out;
+        }
+        if (read(fd, buf, hdr.region_size) != hdr.region_size) {
+            fprintf(stderr, "%s: truncated payload\n", path);
+            goto out;
+        }
+        if (pwrite(out, buf, hdr.region_size, pos) != hdr.region_size) {
+            perror("pwrite");
+            goto out;
+        }
+    }
+
+    printf("%s: seq %llu, %u region(s)\n", path,
+           (unsigned long long)hdr.seq, hdr.count);
+    *seq = hdr.seq;
+    ret = 0;
+out:
+    free(buf);
+    free(index);
+    close(fd);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *usage = "usage: %s [-r] <base> <out> <delta>...\n";
+    uint32_t region_size = 0;
+    uint64_t seq = 0;
+    off_t size, base = 0;
+    const char *out_path;
+    int raw = 0;
+    int out, opt, i;
+
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        switch (opt) {
+        case 'r':
+            raw = 1;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 3) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    out_path = argv[optind + 1];
+
+    if (copy_file(argv[optind], out_path, &size) < 0)
+        return 1;
+
+    out = open(out_path, O_RDWR);
+    if (out < 0) {
+        perror(out_path);
+        return 1;
+    }
+
+    if (!raw && image_header(out, argv[optind], &size, &base, &region_size,
+                             &seq) < 0) {
+        close(out);
+        return 1;
+    }
+
+    for (i = optind + 2; i < argc; ++i) {
+        if (apply_delta(out, argv[i], size, base, region_size, &seq) < 0) {
+            close(out);
+            return 1;
+        }
+    }
+
+    /* The output now stands for the last delta applied */
+    if (base && pwrite(out, &seq, sizeof(seq),
+                       offsetof(struct vblock_image_hdr, seq)) !=
+                sizeof(seq)) {
+        perror(out_path);
+        close(out);
+        return 1;
+    }
+
+    if (fsync(out) < 0)
+        perror("fsync");
+    close(out);
+    return 0;
+}
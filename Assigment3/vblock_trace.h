@@ -0,0 +1,256 @@
+/* vblock_trace.h
+ *
+ * Tracepoints for vblock (events/vblock/ in tracefs). Callers pass the
+ * local_clock() time an operation started and the event records ns
+ * since then, so the closing clock read happens only when the event is
+ * enabled; vblock.c reads the opening one only if the event is
+ * enabled too, unless it needs it anyway. A disabled event costs a
+ * patched-out branch.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vblock
+
+#if !defined(_VBLOCK_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _VBLOCK_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/sched/clock.h>
+
+/* One region access by a reader; nowait is IOCB_NOWAIT / RWF_NOWAIT */
+TRACE_EVENT(vblock_read,
+    TP_PROTO(int dev, int region, loff_t pos, size_t len, bool nowait,
+             int ret, u64 start),
+    TP_ARGS(dev, region, pos, len, nowait, ret, start),
+
+    TP_STRUCT__entry(
+        __field(int,    dev)
+        __field(int,    region)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(bool,   nowait)
+        __field(int,    ret)
+        __field(u64,    ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev    = dev;
+        __entry->region = region;
+        __entry->pos    = pos;
+        __entry->len    = len;
+        __entry->nowait = nowait;
+        __entry->ret    = ret;
+        __entry->ns     = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d region=%d pos=%lld len=%zu nowait=%d ret=%d ns=%llu",
+              __entry->dev, __entry->region, __entry->pos, __entry->len,
+              __entry->nowait, __entry->ret, __entry->ns)
+);
+
+/* One write, from locking its regions to releasing them */
+TRACE_EVENT(vblock_write,
+    TP_PROTO(int dev, int first, int last, loff_t pos, size_t len, int ret,
+             u64 start),
+    TP_ARGS(dev, first, last, pos, len, ret, start),
+
+    TP_STRUCT__entry(
+        __field(int,    dev)
+        __field(int,    first)
+        __field(int,    last)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(int,    ret)
+        __field(u64,    ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev   = dev;
+        __entry->first = first;
+        __entry->last  = last;
+        __entry->pos   = pos;
+        __entry->len   = len;
+        __entry->ret   = ret;
+        __entry->ns    = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d regions=%d-%d pos=%lld len=%zu ret=%d ns=%llu",
+              __entry->dev, __entry->first, __entry->last, __entry->pos,
+              __entry->len, __entry->ret, __entry->ns)
+);
+
+/* Time spent waiting for a contended region mutex */
+TRACE_EVENT(vblock_lock_wait,
+    TP_PROTO(int dev, int region, u64 start),
+    TP_ARGS(dev, region, start),
+
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(int, region)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev    = dev;
+        __entry->region = region;
+        __entry->ns     = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d region=%d ns=%llu", __entry->dev, __entry->region,
+              __entry->ns)
+);
+
+/* A write meeting a locked region: was it let through, and how long
+ * did the key lookup take
+ */
+TRACE_EVENT(vblock_key_check,
+    TP_PROTO(int dev, int region, bool has_key, int key, bool allowed,
+             u64 start),
+    TP_ARGS(dev, region, has_key, key, allowed, start),
+
+    TP_STRUCT__entry(
+        __field(int,  dev)
+        __field(int,  region)
+        __field(bool, has_key)
+        __field(int,  key)
+        __field(bool, allowed)
+        __field(u64,  ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev     = dev;
+        __entry->region  = region;
+        __entry->has_key = has_key;
+        __entry->key     = key;
+        __entry->allowed = allowed;
+        __entry->ns      = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d region=%d has_key=%d key=%d allowed=%d ns=%llu",
+              __entry->dev, __entry->region, __entry->has_key, __entry->key,
+              __entry->allowed, __entry->ns)
+);
+
+/* Every ioctl on a /dev/vblockN; nr is _IOC_NR(cmd) from vblock_ioctl.h */
+TRACE_EVENT(vblock_ioctl,
+    TP_PROTO(int dev, unsigned int cmd, long ret, u64 start),
+    TP_ARGS(dev, cmd, ret, start),
+
+    TP_STRUCT__entry(
+        __field(int,          dev)
+        __field(unsigned int, cmd)
+        __field(long,         ret)
+        __field(u64,          ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+        __entry->ns  = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d cmd=0x%x nr=%u ret=%ld ns=%llu", __entry->dev,
+              __entry->cmd, _IOC_NR(__entry->cmd), __entry->ret, __entry->ns)
+);
+
+/* Data copied into the mirror, by a writer or by vblock_mirror_sync() */
+TRACE_EVENT(vblock_mirror_copy,
+    TP_PROTO(int dev, int region, loff_t pos, size_t len, int ret, u64 start),
+    TP_ARGS(dev, region, pos, len, ret, start),
+
+    TP_STRUCT__entry(
+        __field(int,    dev)
+        __field(int,    region)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(int,    ret)
+        __field(u64,    ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev    = dev;
+        __entry->region = region;
+        __entry->pos    = pos;
+        __entry->len    = len;
+        __entry->ret    = ret;
+        __entry->ns     = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d region=%d pos=%lld len=%zu ret=%d ns=%llu",
+              __entry->dev, __entry->region, __entry->pos, __entry->len,
+              __entry->ret, __entry->ns)
+);
+
+#define VBLOCK_BACKUP_PHASE_OPEN   0  /* filp_open() of the target */
+#define VBLOCK_BACKUP_PHASE_WAIT   1  /* waiting for backup_mutex */
+#define VBLOCK_BACKUP_PHASE_COPY   2  /* all regions written */
+#define VBLOCK_BACKUP_PHASE_CLOSE  3  /* filp_close(), i.e. the flush */
+
+/* One phase of a backup, for the whole file */
+TRACE_EVENT(vblock_backup_phase,
+    TP_PROTO(int dev, int phase, u32 flags, int ret, u64 start),
+    TP_ARGS(dev, phase, flags, ret, start),
+
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(int, phase)
+        __field(u32, flags)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev   = dev;
+        __entry->phase = phase;
+        __entry->flags = flags;
+        __entry->ret   = ret;
+        __entry->ns    = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d phase=%s flags=0x%x ret=%d ns=%llu",
+              __entry->dev,
+              __print_symbolic(__entry->phase,
+                               { VBLOCK_BACKUP_PHASE_OPEN,  "open" },
+                               { VBLOCK_BACKUP_PHASE_WAIT,  "wait" },
+                               { VBLOCK_BACKUP_PHASE_COPY,  "copy" },
+                               { VBLOCK_BACKUP_PHASE_CLOSE, "close" }),
+              __entry->flags, __entry->ret, __entry->ns)
+);
+
+/* One region of a backup; tries > 1 means writers forced redos */
+TRACE_EVENT(vblock_backup_region,
+    TP_PROTO(int dev, int region, loff_t fpos, int tries, int ret, u64 start),
+    TP_ARGS(dev, region, fpos, tries, ret, start),
+
+    TP_STRUCT__entry(
+        __field(int,    dev)
+        __field(int,    region)
+        __field(loff_t, fpos)
+        __field(int,    tries)
+        __field(int,    ret)
+        __field(u64,    ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev    = dev;
+        __entry->region = region;
+        __entry->fpos   = fpos;
+        __entry->tries  = tries;
+        __entry->ret    = ret;
+        __entry->ns     = local_clock() - start;
+    ),
+
+    TP_printk("dev=%d region=%d fpos=%lld tries=%d ret=%d ns=%llu",
+              __entry->dev, __entry->region, __entry->fpos, __entry->tries,
+              __entry->ret, __entry->ns)
+);
+
+#endif /* _VBLOCK_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vblock_trace
+#include <trace/define_trace.h>
@@ -5,10 +5,40 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include<errno.h>
+#include <poll.h>
 #include "vblock_ioctl.h"
 
 #define DEV_PATH "/dev/vblock0"
 
+/* List every locked region, one bitmap page at a time */
+static void print_locked(int fd, unsigned int num_regions)
+{
+    static __u64 words[VBLOCK_LOCKMAP_MAX_BITS / 64];
+    struct vblock_lock_bitmap lb;
+    unsigned int first, i;
+
+    printf("Locked regions:");
+    for (first = 0; first < num_regions; first += lb.nr) {
+        lb.first = first;
+        lb.nr = VBLOCK_LOCKMAP_MAX_BITS;
+        lb.bits = (unsigned long)words;
+        if (ioctl(fd, VBLOCK_GET_LOCK_BITMAP, &lb) < 0) {
+            perror(" GET_LOCK_BITMAP ioctl");
+            return;
+        }
+        for (i = 0; i < lb.nr; ++i) {
+            if (words[i / 64] & (1ULL << (i % 64))) {
+                struct vblock_region_info ri = { .region_index = first + i };
+
+                printf(" %u", first + i);
+                if (ioctl(fd, VBLOCK_GET_REGION_INFO, &ri) == 0)
+                    printf(" (pid %d uid %u)", ri.owner_pid, ri.owner_uid);
+            }
+        }
+    }
+    printf("\n");
+}
+
 void menu()
 {
     printf("\n===== VBLOCK CONTROL MENU =====\n");
@@ -22,12 +52,27 @@ void menu()
     printf("8. Exit\n");
     printf("9. Read MIRROR region\n");
     printf("10. Backup to file\n");
+    printf("11. Binary write (pwrite)\n");
+    printf("12. Async backup to file\n");
+    printf("13. Incremental backup to file\n");
+    printf("14. Snapshot backup to file\n");
+    printf("15. Mirror lag / flush\n");
+    printf("16. Add / revoke key\n");
+    printf("17. Compression stats\n");
+    printf("18. Discard byte range\n");
+    printf("19. I/O statistics\n");
+    printf("20. Image backup / restore\n");
+    printf("21. Add device\n");
+    printf("22. Authenticate session\n");
+    printf("23. Watch regions for changes\n");
     printf("Select: ");
 }
 
-int main()
+int main(int argc, char **argv)
 {
-    int fd = open(DEV_PATH, O_RDWR);
+    /* Optional device path, e.g. /dev/vblock1 */
+    const char *dev_path = argc > 1 ? argv[1] : DEV_PATH;
+    int fd = open(dev_path, O_RDWR);
     if (fd < 0) {
         perror("open");
         return 1;
@@ -77,7 +122,7 @@ if (len < 0) {
 
         } else if (choice == 3) {
             int region;
-            printf("Enter region index (0-7): ");
+            printf("Enter region index: ");
             scanf("%d", &region);
 
             if (ioctl(fd, VBLOCK_LOCK_REGION, &region) < 0)
@@ -87,7 +132,7 @@ if (len < 0) {
 
         } else if (choice == 4) {
             int region;
-            printf("Enter region index (0-7): ");
+            printf("Enter region index: ");
             scanf("%d", &region);
 
             if (ioctl(fd, VBLOCK_UNLOCK_REGION, &region) < 0)
@@ -97,7 +142,7 @@ if (len < 0) {
 
         } else if (choice == 5) {
             struct vblock_region r;
-            printf("Enter region index (0-7): ");
+            printf("Enter region index: ");
             scanf("%d", &r.region_index);
 
             if (ioctl(fd, VBLOCK_READ_REGION, &r) < 0)
@@ -110,7 +155,7 @@ if (len < 0) {
 
         } else if (choice == 6) {
             int region;
-            printf("Enter region index (0-7): ");
+            printf("Enter region index: ");
             scanf("%d", &region);
 
             if (ioctl(fd, VBLOCK_ERASE_REGION, &region) < 0)
@@ -125,10 +170,15 @@ if (len < 0) {
                 perror("GET_INFO ioctl");
             else {
                 printf("=== DEVICE INFO ===\n");
-                printf("Size          : %u\n", info.size);
+                printf("Size          : %llu\n", (unsigned long long)info.size);
                 printf("Region size   : %u\n", info.region_size);
                 printf("Num regions   : %u\n", info.num_regions);
+                printf("Resident pages: %llu (mirror %llu, %u B each)\n",
+                       (unsigned long long)info.resident_pages,
+                       (unsigned long long)info.mirror_pages,
+                       info.page_size);
                 printf("Lock bitmap   : 0x%02x\n", info.lock_bitmap);
+                print_locked(fd, info.num_regions);
             }
 
         } else if (choice == 8) {
@@ -140,7 +190,7 @@ if (len < 0) {
         /* ---------------------- NEW OPTION: READ MIRROR ---------------------- */
         else if (choice == 9) {
             struct vblock_region r;
-            printf("Enter region index (0-7): ");
+            printf("Enter region index: ");
             scanf("%d", &r.region_index);
 
             if (ioctl(fd, VBLOCK_READ_MIRROR, &r) < 0)
@@ -164,6 +214,375 @@ if (len < 0) {
                 printf("Backup saved to %s\n", path);
         }
 
+        /* ---------------------- NEW OPTION: BINARY WRITE ---------------------- */
+        else if (choice == 11) {
+            struct vblock_mode mode = { .mode = VBLOCK_MODE_BINARY };
+            char writebuf[1024];
+            long long offset;
+            int bfd;
+
+            printf("Enter key (-1 for none): ");
+            scanf("%d", &mode.key);
+            printf("Enter offset: ");
+            scanf("%lld", &offset);
+            printf("Enter data: ");
+            scanf("%1023s", writebuf);
+
+            if (mode.key != -1)
+                mode.flags = VBLOCK_MODE_F_KEY;
+
+            /* Separate descriptor so option 1 keeps the ASCII format */
+            bfd = open(dev_path, O_RDWR);
+            if (bfd < 0) {
+                perror("open");
+            } else if (ioctl(bfd, VBLOCK_SET_MODE, &mode) < 0) {
+                perror("SET_MODE ioctl");
+            } else {
+                ssize_t len = pwrite(bfd, writebuf, strlen(writebuf), offset);
+
+                if (len < 0)
+                    perror("pwrite");
+                else
+                    printf("Write OK (%ld bytes)\n", len);
+            }
+            if (bfd >= 0)
+                close(bfd);
+        }
+
+        /* ---------------------- NEW OPTION: ASYNC BACKUP ---------------------- */
+        else if (choice == 12) {
+            struct vblock_backup_req req = { .eventfd = -1 };
+            struct vblock_backup_status st = { 0 };
+            struct pollfd pfd = { .fd = fd, .events = POLLPRI };
+
+            printf("Enter filename for backup (ex: /tmp/vblock.bin): ");
+            scanf("%255s", req.path);
+
+            if (ioctl(fd, VBLOCK_BACKUP_ASYNC, &req) < 0) {
+                perror("BACKUP_ASYNC ioctl");
+                continue;
+            }
+            printf("Backup job %u queued, waiting...\n", req.job_id);
+
+            if (poll(&pfd, 1, -1) < 0)
+                perror("poll");
+
+            st.job_id = req.job_id;
+            st.flags = VBLOCK_JOB_F_REAP;
+            if (ioctl(fd, VBLOCK_BACKUP_STATUS, &st) < 0)
+                perror("BACKUP_STATUS ioctl");
+            else if (st.error)
+                printf("Backup failed: %s\n", strerror(-st.error));
+            else
+                printf("Backup done: %llu bytes in %.3f ms\n",
+                       (unsigned long long)st.bytes, st.elapsed_ns / 1e6);
+        }
+
+        /* ---------------------- NEW OPTION: INCREMENTAL BACKUP ---------------------- */
+        else if (choice == 13) {
+            struct vblock_backup_req req = {
+                .eventfd = -1,
+                .flags = VBLOCK_BACKUP_F_INCREMENTAL,
+            };
+
+            printf("Enter filename for delta (ex: /tmp/vblock.d1): ");
+            scanf("%255s", req.path);
+
+            if (ioctl(fd, VBLOCK_BACKUP_EX, &req) < 0)
+                perror("BACKUP_EX ioctl");
+            else
+                printf("Delta saved to %s (apply with vblock_merge)\n", req.path);
+        }
+
+        /* ---------------------- NEW OPTION: SNAPSHOT BACKUP ---------------------- */
+        else if (choice == 14) {
+            struct vblock_backup_req req = {
+                .eventfd = -1,
+                .flags = VBLOCK_BACKUP_F_SNAPSHOT,
+            };
+            __u64 id;
+
+            printf("Enter filename for backup (ex: /tmp/vblock.snap): ");
+            scanf("%255s", req.path);
+
+            if (ioctl(fd, VBLOCK_SNAPSHOT_CREATE, &id) < 0) {
+                perror("SNAPSHOT_CREATE ioctl");
+                continue;
+            }
+
+            /* Writers keep going; the image is the device as of CREATE */
+            if (ioctl(fd, VBLOCK_BACKUP_EX, &req) < 0)
+                perror("BACKUP_EX ioctl");
+            else
+                printf("Snapshot %llu saved to %s\n",
+                       (unsigned long long)id, req.path);
+
+            if (ioctl(fd, VBLOCK_SNAPSHOT_DROP) < 0)
+                perror("SNAPSHOT_DROP ioctl");
+        }
+
+        /* ---------------------- NEW OPTION: MIRROR LAG ---------------------- */
+        else if (choice == 15) {
+            struct vblock_mirror_stat st;
+
+            if (ioctl(fd, VBLOCK_MIRROR_STAT, &st) < 0) {
+                perror("MIRROR_STAT ioctl");
+                continue;
+            }
+            printf("Mirror mode: %s\n", st.async ? "async" : "sync");
+            printf("Pending: %u regions, %llu bytes, oldest %.3f ms\n",
+                   st.regions_pending, (unsigned long long)st.bytes_pending,
+                   st.oldest_ns / 1e6);
+            printf("Worker batches: %llu, regions synced: %llu\n",
+                   (unsigned long long)st.batches,
+                   (unsigned long long)st.regions_synced);
+
+            if (st.regions_pending) {
+                if (ioctl(fd, VBLOCK_MIRROR_FLUSH) < 0)
+                    perror("MIRROR_FLUSH ioctl");
+                else
+                    printf("Mirror flushed\n");
+            }
+        }
+
+        /* ---------------------- NEW OPTION: KEYS ---------------------- */
+        else if (choice == 16) {
+            struct vblock_key_req req = { 0 };
+            __u64 mask = 0;
+            int op, region;
+
+            printf("1 = add, 2 = revoke: ");
+            scanf("%d", &op);
+            printf("Enter key: ");
+            scanf("%d", &req.key);
+
+            if (op == 2) {
+                if (ioctl(fd, VBLOCK_KEY_REVOKE, &req.key) < 0)
+                    perror("KEY_REVOKE ioctl");
+                else
+                    printf("Key %d revoked\n", req.key);
+                continue;
+            }
+
+            printf("Bind to region (-1 for all, 0-63 otherwise): ");
+            scanf("%d", &region);
+            if (region >= 0 && region < 64) {
+                mask = 1ULL << region;
+                req.flags = VBLOCK_KEY_F_REGIONS;
+                req.mask_bits = region + 1;
+                req.mask = (unsigned long)&mask;
+            }
+
+            if (ioctl(fd, VBLOCK_KEY_ADD, &req) < 0)
+                perror("KEY_ADD ioctl");
+            else
+                printf("Key %d added\n", req.key);
+        }
+
+        /* ---------------------- NEW OPTION: COMPRESSION ---------------------- */
+        else if (choice == 17) {
+            struct vblock_compress_stat st;
+
+            if (ioctl(fd, VBLOCK_COMPRESS_STAT, &st) < 0) {
+                perror("COMPRESS_STAT ioctl");
+                continue;
+            }
+            if (!st.enabled) {
+                printf("Compression is off (load with compress=1)\n");
+                continue;
+            }
+            printf("Regions: %u hot (limit %u), %u cold\n",
+                   st.hot_regions, st.hot_limit, st.cold_regions);
+            printf("Cold data: %llu -> %llu bytes (ratio %.2f)\n",
+                   (unsigned long long)st.raw_bytes,
+                   (unsigned long long)st.compressed_bytes,
+                   st.compressed_bytes ?
+                   (double)st.raw_bytes / st.compressed_bytes : 0);
+            printf("Accesses: %llu, thaws: %llu (hit rate %.2f%%)\n",
+                   (unsigned long long)st.accesses,
+                   (unsigned long long)st.thaws,
+                   st.accesses ?
+                   100.0 * (1 - (double)st.thaws / st.accesses) : 100.0);
+            printf("Freezes: %llu, rejected: %llu\n",
+                   (unsigned long long)st.freezes,
+                   (unsigned long long)st.rejects);
+        }
+
+        /* ---------------------- NEW OPTION: DISCARD ---------------------- */
+        else if (choice == 18) {
+            struct vblock_discard d = { 0 };
+            unsigned long long off, len;
+
+            printf("Enter offset and length in bytes: ");
+            scanf("%llu %llu", &off, &len);
+            d.offset = off;
+            d.len = len;
+
+            if (ioctl(fd, VBLOCK_DISCARD, &d) < 0)
+                perror("DISCARD ioctl");
+            else
+                printf("Discarded %llu bytes at %llu\n", len, off);
+        }
+
+        /* ---------------------- NEW OPTION: STATISTICS ---------------------- */
+        else if (choice == 19) {
+            static const char *names[VBLOCK_LAT_NR] = {
+                "read", "write", "backup", "lock wait"
+            };
+            struct vblock_region_stats rs;
+            struct vblock_latency lat;
+            struct vblock_stats req = { 0 };
+            int i, b;
+
+            printf("Enter region index: ");
+            scanf("%u", &req.first);
+            req.nr = 1;
+            req.regions = (unsigned long)&rs;
+            req.latency = (unsigned long)&lat;
+
+            if (ioctl(fd, VBLOCK_GET_STATS, &req) < 0) {
+                perror("GET_STATS ioctl");
+                continue;
+            }
+            if (req.nr)
+                printf("Region %u: %llu reads (%llu B), %llu writes (%llu B), "
+                       "%llu erases, %llu lock / %llu key failures, "
+                       "%llu checksum errors (%llu repaired)\n",
+                       req.first, (unsigned long long)rs.reads,
+                       (unsigned long long)rs.read_bytes,
+                       (unsigned long long)rs.writes,
+                       (unsigned long long)rs.write_bytes,
+                       (unsigned long long)rs.erases,
+                       (unsigned long long)rs.lock_fails,
+                       (unsigned long long)rs.key_fails,
+                       (unsigned long long)rs.csum_errors,
+                       (unsigned long long)rs.repairs);
+
+            for (i = 0; i < VBLOCK_LAT_NR; ++i) {
+                printf("%s latency (ns):\n", names[i]);
+                for (b = 0; b < VBLOCK_HIST_BUCKETS; ++b)
+                    if (lat.hist[i][b])
+                        printf("  %s %llu: %llu\n",
+                               b == VBLOCK_HIST_BUCKETS - 1 ? ">=" : "<",
+                               b == VBLOCK_HIST_BUCKETS - 1 ? 1ULL << (b - 1)
+                                                            : 1ULL << b,
+                               (unsigned long long)lat.hist[i][b]);
+            }
+        }
+
+        /* ---------------------- NEW OPTION: IMAGE / RESTORE ---------------------- */
+        else if (choice == 20) {
+            struct vblock_backup_req req = { .eventfd = -1 };
+            struct vblock_restore_req rr = { 0 };
+            int op;
+
+            printf("1 = back up to an image, 2 = restore from a file, "
+                   "3 = restore a raw image: ");
+            scanf("%d", &op);
+            printf("Enter file path: ");
+            scanf("%255s", op == 1 ? req.path : rr.path);
+
+            if (op == 1) {
+                req.flags = VBLOCK_BACKUP_F_IMAGE;
+                if (ioctl(fd, VBLOCK_BACKUP_EX, &req) < 0)
+                    perror("BACKUP_EX ioctl");
+                else
+                    printf("Image written to %s\n", req.path);
+                continue;
+            }
+
+            rr.flags = op == 3 ? VBLOCK_RESTORE_F_RAW : VBLOCK_RESTORE_F_LOCKS;
+            if (ioctl(fd, VBLOCK_RESTORE, &rr) < 0)
+                perror("RESTORE ioctl");
+            else
+                printf("Restored %u regions from %s\n", rr.restored, rr.path);
+        }
+
+        else if (choice == 21) {
+            struct vblock_dev_req dr = { 0 };
+            unsigned long long size;
+
+            printf("Enter size in bytes (0 = module default): ");
+            scanf("%llu", &size);
+            printf("Enter region size in bytes (0 = module default): ");
+            scanf("%u", &dr.region_size);
+            dr.size = size;
+
+            if (ioctl(fd, VBLOCK_DEV_ADD, &dr) < 0)
+                perror("DEV_ADD ioctl");
+            else
+                printf("Created /dev/vblock%u and /dev/vblk%u\n", dr.id, dr.id);
+        }
+
+        else if (choice == 22) {
+            struct vblock_auth au = { 0 };
+
+            printf("Enter key (-1 to end the session): ");
+            scanf("%d", &au.key);
+            if (au.key == -1)
+                au.flags = VBLOCK_AUTH_F_END;
+
+            if (ioctl(fd, VBLOCK_AUTH, &au) < 0)
+                perror("AUTH ioctl");
+            else if (au.flags)
+                printf("Session ended\n");
+            else
+                printf("Session started, %u regions writable "
+                       "(write as offset:data)\n", au.regions);
+        }
+
+        else if (choice == 23) {
+            static __u64 words[VBLOCK_MAX_REGIONS / 64];
+            static struct vblock_change ch[64];
+            struct vblock_changes rc = { 0 };
+            struct vblock_watch w = { 0 };
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            unsigned int first, last, r, i;
+            int timeout, ok = 1;
+
+            printf("Enter first and last region to watch: ");
+            scanf("%u %u", &first, &last);
+            printf("Enter timeout in seconds: ");
+            scanf("%d", &timeout);
+            if (first > last || last >= VBLOCK_MAX_REGIONS) {
+                printf("Invalid range\n");
+                continue;
+            }
+
+            memset(words, 0, sizeof(words));
+            for (r = first; r <= last; ++r)
+                words[r / 64] |= 1ULL << (r % 64);
+            w.mask = (unsigned long)words;
+            w.mask_bits = last + 1;
+            if (ioctl(fd, VBLOCK_WATCH, &w) < 0) {
+                perror("WATCH ioctl");
+                continue;
+            }
+
+            printf("Waiting for changes...\n");
+            while (ok && poll(&pfd, 1, timeout * 1000) > 0) {
+                do {
+                    rc.entries = (unsigned long)ch;
+                    rc.max = 64;
+                    if (ioctl(fd, VBLOCK_WATCH_CHANGES, &rc) < 0) {
+                        perror("WATCH_CHANGES ioctl");
+                        ok = 0;
+                        break;
+                    }
+                    for (i = 0; i < rc.nr; ++i)
+                        printf("region %u: gen %llu lock_gen %llu%s\n",
+                               ch[i].region, (unsigned long long)ch[i].gen,
+                               (unsigned long long)ch[i].lock_gen,
+                               ch[i].locked ? " (locked)" : "");
+                } while (rc.flags & VBLOCK_CHANGES_F_MORE);
+            }
+            if (ok)
+                printf("No change for %d s, stopped watching\n", timeout);
+
+            w.mask_bits = 0;
+            ioctl(fd, VBLOCK_WATCH, &w);
+        }
+
         else {
             printf("Invalid choice.\n");
         }